@@ -0,0 +1,255 @@
+#include <string.h>
+
+#include "link_protocol.h"
+
+#define LINK_CRC_POS        (LINK_FRAME_LEN - 2)
+#define LINK_PAYLOAD_POS    4
+#define LINK_AGE_POS        (LINK_PAYLOAD_POS + 5)     // in a sample response
+
+// CRC-16/CCITT-FALSE, poly 0x1021, init 0xffff, four bits per step
+static const uint16_t crc_nibble[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+uint16_t link_crc16(const uint8_t *data, uint len) {
+    uint16_t crc = 0xffff;
+    for (uint i = 0; i < len; i++) {
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] & 0x0f)];
+    }
+    return crc;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void put_crc(uint8_t buf[LINK_FRAME_LEN]) {
+    uint16_t crc = link_crc16(buf, LINK_CRC_POS);
+    buf[LINK_CRC_POS] = (uint8_t)(crc >> 8);
+    buf[LINK_CRC_POS + 1] = (uint8_t)crc;
+}
+
+void link_encode(const LinkFrame_t *frame, uint8_t buf[LINK_FRAME_LEN]) {
+    uint len = (frame->len > LINK_MAX_PAYLOAD) ? LINK_MAX_PAYLOAD : frame->len;
+    memset(buf, 0, LINK_FRAME_LEN);
+    buf[0] = LINK_HEADER;
+    buf[1] = frame->cmd;
+    buf[2] = frame->seq;
+    buf[3] = (uint8_t)len;
+    memcpy(&buf[LINK_PAYLOAD_POS], frame->payload, len);
+    put_crc(buf);
+}
+
+LinkResult link_decode(const uint8_t buf[LINK_FRAME_LEN], LinkFrame_t *frame) {
+    // a line nobody drives reads as all zeros or all ones
+    bool zeros = true;
+    bool ones = true;
+    for (uint i = 0; i < LINK_FRAME_LEN; i++) {
+        zeros = zeros && (buf[i] == 0x00);
+        ones = ones && (buf[i] == 0xff);
+    }
+    if (zeros || ones) {
+        return kLinkEmpty;
+    }
+    if (buf[0] != LINK_HEADER) {
+        return kLinkBadHeader;
+    }
+    if (buf[3] > LINK_MAX_PAYLOAD) {
+        return kLinkBadLength;
+    }
+    uint16_t crc = (uint16_t)((buf[LINK_CRC_POS] << 8) | buf[LINK_CRC_POS + 1]);
+    if (crc != link_crc16(buf, LINK_CRC_POS)) {
+        return kLinkBadCrc;
+    }
+    frame->cmd = buf[1];
+    frame->seq = buf[2];
+    frame->len = buf[3];
+    memcpy(frame->payload, &buf[LINK_PAYLOAD_POS], frame->len);
+    return kLinkOk;
+}
+
+// Update sequence number and, for a sample response, the sample age of an
+// encoded frame right before it goes out.
+void link_patch(uint8_t buf[LINK_FRAME_LEN], uint8_t seq, uint16_t age_ms) {
+    buf[2] = seq;
+    if (buf[1] == kLinkRspSample) {
+        put_u16(&buf[LINK_AGE_POS], age_ms);
+    }
+    put_crc(buf);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(&p[0], (uint16_t)v);
+    put_u16(&p[2], (uint16_t)(v >> 16));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(&p[0]) | ((uint32_t)get_u16(&p[2]) << 16);
+}
+
+void link_put_sample(LinkFrame_t *frame, int32_t grams, uint8_t flags, uint16_t age_ms, uint8_t pending) {
+    frame->cmd = kLinkRspSample;
+    frame->len = 8;
+    put_u32(&frame->payload[0], (uint32_t)grams);
+    frame->payload[4] = flags;
+    put_u16(&frame->payload[5], age_ms);
+    frame->payload[7] = pending;
+}
+
+bool link_get_sample(const LinkFrame_t *frame, int32_t *grams, uint8_t *flags, uint16_t *age_ms, uint8_t *pending) {
+    if ((frame->cmd != kLinkRspSample) || (frame->len < 8)) {
+        return false;
+    }
+    *grams = (int32_t)get_u32(&frame->payload[0]);
+    *flags = frame->payload[4];
+    *age_ms = get_u16(&frame->payload[5]);
+    *pending = frame->payload[7];
+    return true;
+}
+
+void link_put_latched(LinkFrame_t *frame, int32_t grams, uint8_t flags, uint8_t latch, int16_t skew_us) {
+    frame->cmd = kLinkRspLatched;
+    frame->len = 8;
+    put_u32(&frame->payload[0], (uint32_t)grams);
+    frame->payload[4] = flags;
+    frame->payload[5] = latch;
+    put_u16(&frame->payload[6], (uint16_t)skew_us);
+}
+
+bool link_get_latched(const LinkFrame_t *frame, int32_t *grams, uint8_t *flags, uint8_t *latch, int16_t *skew_us) {
+    if ((frame->cmd != kLinkRspLatched) || (frame->len < 8)) {
+        return false;
+    }
+    *grams = (int32_t)get_u32(&frame->payload[0]);
+    *flags = frame->payload[4];
+    *latch = frame->payload[5];
+    *skew_us = (int16_t)get_u16(&frame->payload[6]);
+    return true;
+}
+
+void link_put_read(LinkFrame_t *frame, uint8_t latch) {
+    frame->cmd = kLinkCmdRead;
+    frame->len = 1;
+    frame->payload[0] = latch;
+}
+
+// number of the next latch, false for commands without one
+bool link_get_latch(const LinkFrame_t *frame, uint8_t *latch) {
+    if ((frame->cmd == kLinkCmdRead) && (frame->len >= 1)) {
+        *latch = frame->payload[0];
+        return true;
+    }
+    if ((frame->cmd == kLinkCmdBurst) && (frame->len >= 7)) {
+        *latch = frame->payload[6];
+        return true;
+    }
+    return false;
+}
+
+void link_put_burst_cmd(LinkFrame_t *frame, const LinkBurstCmd_t *cmd) {
+    frame->cmd = kLinkCmdBurst;
+    frame->len = 7;
+    frame->payload[0] = cmd->count;
+    frame->payload[1] = cmd->flags;
+    put_u32(&frame->payload[2], cmd->ack_us);
+    frame->payload[6] = cmd->latch;
+}
+
+bool link_get_burst_cmd(const LinkFrame_t *frame, LinkBurstCmd_t *cmd) {
+    if ((frame->cmd != kLinkCmdBurst) || (frame->len < 1)) {
+        return false;
+    }
+    cmd->count = frame->payload[0];
+    // older heads send the count alone
+    cmd->flags = (frame->len >= 6) ? frame->payload[1] : 0;
+    cmd->ack_us = (frame->len >= 6) ? get_u32(&frame->payload[2]) : 0;
+    cmd->latch = (frame->len >= 7) ? frame->payload[6] : 0;
+    return true;
+}
+
+void link_put_burst(LinkFrame_t *frame, const LinkBurst_t *burst) {
+    frame->cmd = kLinkRspBurst;
+    frame->len = 8;
+    frame->payload[0] = burst->count;
+    frame->payload[1] = burst->pending;
+    put_u16(&frame->payload[2], burst->block_crc);
+    put_u32(&frame->payload[4], burst->now_us);
+}
+
+bool link_get_burst(const LinkFrame_t *frame, LinkBurst_t *burst) {
+    if ((frame->cmd != kLinkRspBurst) || (frame->len < 8) || (frame->payload[0] > LINK_BURST_MAX)) {
+        return false;
+    }
+    burst->count = frame->payload[0];
+    burst->pending = frame->payload[1];
+    burst->block_crc = get_u16(&frame->payload[2]);
+    burst->now_us = get_u32(&frame->payload[4]);
+    return true;
+}
+
+void link_put_burst_sample(uint8_t *block, uint index, const LinkBurstSample_t *sample) {
+    uint8_t *p = &block[index * LINK_BURST_SAMPLE_LEN];
+    // 24 bit are plenty for grams, +-8388 kg
+    int32_t grams = sample->grams;
+    if (grams > 0x7fffff) grams = 0x7fffff;
+    if (grams < -0x800000) grams = -0x800000;
+    p[0] = (uint8_t)grams;
+    p[1] = (uint8_t)(grams >> 8);
+    p[2] = (uint8_t)(grams >> 16);
+    p[3] = sample->flags;
+    put_u32(&p[4], sample->time_us);
+}
+
+void link_get_burst_sample(const uint8_t *block, uint index, LinkBurstSample_t *sample) {
+    const uint8_t *p = &block[index * LINK_BURST_SAMPLE_LEN];
+    sample->grams = (int32_t)((uint32_t)(p[0] | (p[1] << 8) | (p[2] << 16)) << 8) >> 8;
+    sample->flags = p[3];
+    sample->time_us = get_u32(&p[4]);
+}
+
+void link_put_set_rate(LinkFrame_t *frame, uint8_t channel, uint16_t sps) {
+    frame->cmd = kLinkCmdSetRate;
+    frame->len = 3;
+    frame->payload[0] = channel;
+    put_u16(&frame->payload[1], sps);
+}
+
+bool link_get_set_rate(const LinkFrame_t *frame, uint8_t *channel, uint16_t *sps) {
+    if ((frame->cmd != kLinkCmdSetRate) || (frame->len < 3)) {
+        return false;
+    }
+    *channel = frame->payload[0];
+    *sps = get_u16(&frame->payload[1]);
+    return true;
+}
+
+void link_put_status(LinkFrame_t *frame, const LinkStatus_t *status) {
+    frame->cmd = kLinkRspStatus;
+    frame->len = 10;
+    frame->payload[0] = status->version;
+    put_u16(&frame->payload[1], status->rate_sps[0]);
+    put_u16(&frame->payload[3], status->rate_sps[1]);
+    frame->payload[5] = status->tare_state;
+    put_u16(&frame->payload[6], status->link_errors);
+    put_u16(&frame->payload[8], status->overflows);
+}
+
+bool link_get_status(const LinkFrame_t *frame, LinkStatus_t *status) {
+    if ((frame->cmd != kLinkRspStatus) || (frame->len < 10)) {
+        return false;
+    }
+    status->version = frame->payload[0];
+    status->rate_sps[0] = get_u16(&frame->payload[1]);
+    status->rate_sps[1] = get_u16(&frame->payload[3]);
+    status->tare_state = frame->payload[5];
+    status->link_errors = get_u16(&frame->payload[6]);
+    status->overflows = get_u16(&frame->payload[8]);
+    return true;
+}
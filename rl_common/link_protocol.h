@@ -0,0 +1,138 @@
+// Author: Christoph Deussen
+//
+// Framed protocol on the SPI link between head unit and subs. Every
+// transaction moves one fixed size frame in each direction:
+//
+//   [0]      header, LINK_HEADER_MAGIC | version
+//   [1]      command or response id
+//   [2]      sequence number
+//   [3]      payload length
+//   [4..13]  payload, little endian
+//   [14..15] CRC-16/CCITT over bytes 0..13, big endian
+//
+// A sub prepares its frame before chip select goes low, so the response
+// to a command arrives with the next transaction. Its sequence number is
+// the one of the last valid command the sub received.
+//
+// A burst response is followed by a block of LINK_BURST_SAMPLE_LEN bytes
+// per requested sample in the same transaction. The head clocks exactly
+// as many as it asked for with the command before. The sub keeps the
+// samples it sent until a later burst command acknowledges them by the
+// time of the last sample the head got, a burst lost on the way is asked
+// for again with LINK_BURST_REWIND. A command with the count alone
+// acknowledges everything sent before.
+//
+// A rising edge on the shared sync line latches the weight of all subs at
+// the same instant. Each sub answers a latch once with kLinkRspLatched
+// instead of its next sample. Read and burst commands carry the number
+// the head gives its next latch, so all subs answer with the same number
+// no matter when they booted.
+
+#ifndef LINK_PROTOCOL_H
+#define LINK_PROTOCOL_H
+
+#include "pico/stdlib.h"
+
+#define LINK_FRAME_LEN      16
+#define LINK_MAX_PAYLOAD    10
+#define LINK_VERSION        1
+#define LINK_HEADER_MAGIC   0xa0
+#define LINK_HEADER         (LINK_HEADER_MAGIC | LINK_VERSION)
+
+#define LINK_BURST_MAX          32
+#define LINK_BURST_SAMPLE_LEN   8       // grams (i24), flags, sub time in us (u32)
+#define LINK_BURST_MAX_LEN      (LINK_FRAME_LEN + LINK_BURST_MAX * LINK_BURST_SAMPLE_LEN)
+
+// flags of a sample response
+#define LINK_FLAG_STABLE    0x01    // no motion on the pad
+#define LINK_FLAG_TARE_BUSY 0x02    // tare running, value is held
+#define LINK_FLAG_TARE_DONE 0x04    // last tare finished
+#define LINK_FLAG_GAP       0x08    // samples before this one were lost
+
+// flags of a burst command
+#define LINK_BURST_ACK      0x01    // samples up to ack_us arrived, the sub drops them
+#define LINK_BURST_REWIND   0x02    // send again all samples not acknowledged
+
+typedef enum LinkCmd {
+    // head to sub
+    kLinkCmdRead        = 0x01,     // next latch number
+    kLinkCmdTare        = 0x02,     // no payload
+    kLinkCmdSetRate     = 0x03,     // channel (0 = both), samples per second (u16)
+    kLinkCmdStatus      = 0x04,     // no payload
+    kLinkCmdEcho        = 0x05,     // test pattern, answered with kLinkRspEcho
+    kLinkCmdBurst       = 0x06,     // samples to send (u8), flags, ack time in us (u32), next latch number,
+                                    // answered with kLinkRspBurst
+    // sub to head
+    kLinkRspSample      = 0x81,     // grams (i32), flags, age in ms (u16), samples buffered
+    kLinkRspStatus      = 0x84,     // see LinkStatus_t
+    kLinkRspEcho        = 0x85,     // payload of the kLinkCmdEcho before
+    kLinkRspBurst       = 0x86,     // samples in block, still buffered, block CRC (u16), sub time in us (u32)
+    kLinkRspLatched     = 0x87      // grams (i32), flags, latch number, skew in us (i16)
+} LinkCmd;
+
+typedef enum LinkResult {
+    kLinkOk             = 0,
+    kLinkEmpty          = 1,        // nobody drove the line
+    kLinkBadHeader      = 2,
+    kLinkBadLength      = 3,
+    kLinkBadCrc         = 4
+} LinkResult;
+
+typedef struct {
+    uint8_t cmd;
+    uint8_t seq;
+    uint8_t len;
+    uint8_t payload[LINK_MAX_PAYLOAD];
+} LinkFrame_t;
+
+typedef struct {
+    int32_t grams;
+    uint8_t flags;
+    uint32_t time_us;           // conversion time on the clock of the sub
+} LinkBurstSample_t;
+
+typedef struct {
+    uint8_t count;              // samples to send
+    uint8_t flags;              // LINK_BURST_*
+    uint32_t ack_us;            // sub time of the last sample the head got
+    uint8_t latch;              // number of the next latch
+} LinkBurstCmd_t;
+
+typedef struct {
+    uint8_t count;              // samples in the block
+    uint8_t pending;            // samples still buffered on the sub
+    uint16_t block_crc;
+    uint32_t now_us;            // time the burst was put together
+} LinkBurst_t;
+
+typedef struct {
+    uint8_t version;
+    uint16_t rate_sps[2];
+    uint8_t tare_state;
+    uint16_t link_errors;
+    uint16_t overflows;         // samples lost in the acquisition
+} LinkStatus_t;
+
+uint16_t link_crc16(const uint8_t *data, uint len);
+void link_encode(const LinkFrame_t *frame, uint8_t buf[LINK_FRAME_LEN]);
+LinkResult link_decode(const uint8_t buf[LINK_FRAME_LEN], LinkFrame_t *frame);
+void link_patch(uint8_t buf[LINK_FRAME_LEN], uint8_t seq, uint16_t age_ms);
+
+void link_put_sample(LinkFrame_t *frame, int32_t grams, uint8_t flags, uint16_t age_ms, uint8_t pending);
+bool link_get_sample(const LinkFrame_t *frame, int32_t *grams, uint8_t *flags, uint16_t *age_ms, uint8_t *pending);
+void link_put_latched(LinkFrame_t *frame, int32_t grams, uint8_t flags, uint8_t latch, int16_t skew_us);
+bool link_get_latched(const LinkFrame_t *frame, int32_t *grams, uint8_t *flags, uint8_t *latch, int16_t *skew_us);
+void link_put_read(LinkFrame_t *frame, uint8_t latch);
+bool link_get_latch(const LinkFrame_t *frame, uint8_t *latch);
+void link_put_burst_cmd(LinkFrame_t *frame, const LinkBurstCmd_t *cmd);
+bool link_get_burst_cmd(const LinkFrame_t *frame, LinkBurstCmd_t *cmd);
+void link_put_burst(LinkFrame_t *frame, const LinkBurst_t *burst);
+bool link_get_burst(const LinkFrame_t *frame, LinkBurst_t *burst);
+void link_put_burst_sample(uint8_t *block, uint index, const LinkBurstSample_t *sample);
+void link_get_burst_sample(const uint8_t *block, uint index, LinkBurstSample_t *sample);
+void link_put_set_rate(LinkFrame_t *frame, uint8_t channel, uint16_t sps);
+bool link_get_set_rate(const LinkFrame_t *frame, uint8_t *channel, uint16_t *sps);
+void link_put_status(LinkFrame_t *frame, const LinkStatus_t *status);
+bool link_get_status(const LinkFrame_t *frame, LinkStatus_t *status);
+
+#endif
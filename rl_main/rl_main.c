@@ -6,15 +6,26 @@
 // Data can be displayed in KGs or in percentage of total weight.
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "pico/binary_info.h"
+#include "pico/multicore.h"
+#include "pico/sync.h"
 #include "hardware/spi.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
 #include "hw.h"
 #include "tst_funcs.h"
 #include "ST7735_TFT.h"
 #include "display_helpers.h"
+#include "link_protocol.h"
+#include "load_curve.h"
+#include "scheduler.h"
+#include "link_master.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "stream.h"
 
-#define BUF_LEN         4
 #define NUM_MODES       3
 
 #define SPI_COM_PORT    spi0
@@ -22,18 +33,64 @@
 #define SPI_COM_TX      19
 #define SPI_COM_SCK     18
 
-#define NUM_PINS        12
+#define NUM_LEDS        4       // subs 1 to 4 show their reads on a LED
 #define LED0            29
 #define LED1            28
 #define LED2            27
 #define LED3            26
+#if CS_DECODER
+// The chip selects of the subs are the outputs of a 74HC154, the address
+// of the selected sub is set on A0..A3.
+#define NUM_PINS        14
+#define SPI_COM_A0      22      // A0..A3 on 22..25
+#define SPI_COM_CS_EN   21      // enable of the decoder, all chip selects stay high while this is high
+#else
+#define NUM_PINS        13
 #define SPI_COM_CS0     25
 #define SPI_COM_CS1     24
 #define SPI_COM_CS2     23
 #define SPI_COM_CS3     22
+#endif
 #define BTN_IN          14
+#define SYNC_OUT        15      // latch line to all subs
 
-#define KG_CALIB_FACTOR 26700.0f
+#define GRAMS_PER_KG    1000.0f     // subs send calibrated grams
+
+#define FLASH_TARGET_OFFSET (512 * 1024)
+#define SETTINGS_MAGIC      0x33484c52      // "RLH3"
+
+#define LINK_BAUD_DEFAULT   (100 * 1000)
+#define LINK_TRAIN_FRAMES   200     // echo frames per tested clock
+#define LINK_TRAIN_GAP_US   50      // sub rearms its DMA between frames
+#define NUM_LINK_RATES      9
+#define LINK_NOT_TESTED     0xffff
+#define LINK_BURST_TIME_US  1500    // longest transaction spent on a burst
+#define SYNC_SLOT_US        100000  // latch halfway between two reads of all subs
+#define SUB_ABSENT_FAILS    3       // empty frames in a row until a sub counts as gone
+#define SUB_RECOVER_FRAMES  25      // good frames in a row to leave the degraded state
+#define SUB_BACKOFF_MAX     32      // longest wait between two probes in poll rounds
+#define SUB_SENSE_US        2       // chip select low until MISO is read
+#define SUB_TARE_START_US   1000000 // acknowledged tare that never shows up as busy is given up
+#define SYNC_PULSE_US       5
+#define PAGE_RENDERS        10      // frames until the next page of subs is shown
+#define BTN_TARE_COUNT      20      // held 2 s and released: tare all subs
+#define BTN_RECORD_COUNT    50      // held 5 s: start or stop the recorder
+
+// boot phase timings in us since reset, printed once a USB host connects
+#define NUM_BOOT_PHASES 4
+typedef enum BootPhase {
+    kBootHw         = 0,    // pins and SPI set up
+    kBootFirstRead  = 1,    // first zeroed weight from a sub
+    kBootTft        = 2,    // display initialized on core1
+    kBootFirstFrame = 3     // first weights on screen
+} BootPhase;
+
+// Everything stored in flash
+typedef struct {
+    uint32_t magic;
+    uint32_t link_baud[NUM_SUBS];                       // fastest clock without errors
+    uint16_t link_bit_errors[NUM_SUBS][NUM_LINK_RATES]; // result of the last training
+} Settings_t;
 
 typedef struct Pin {
     uint pin_num;
@@ -41,167 +98,346 @@ typedef struct Pin {
     bool polarity;
 } Pin;
 
-SubModule sub_modules[NUM_SUBS] = {
-    {.led_pin = LED0, .cs_pin = SPI_COM_CS0, .result = 0.0f},
-    {.led_pin = LED1, .cs_pin = SPI_COM_CS1, .result = 0.0f},
-    {.led_pin = LED2, .cs_pin = SPI_COM_CS2, .result = 0.0f},
-    {.led_pin = LED3, .cs_pin = SPI_COM_CS3, .result = 0.0f}
-};
+SubModule sub_modules[NUM_SUBS];
+
+const uint sub_led_pins[NUM_LEDS] = { LED0, LED1, LED2, LED3 };
+#if !CS_DECODER
+const uint sub_cs_pins[NUM_SUBS] = { SPI_COM_CS0, SPI_COM_CS1, SPI_COM_CS2, SPI_COM_CS3 };
+#endif
 
 const Pin pins[NUM_PINS] = {
     {.pin_num = LED0, .direction = GPIO_OUT, .polarity = 0},
     {.pin_num = LED1, .direction = GPIO_OUT, .polarity = 0},
     {.pin_num = LED2, .direction = GPIO_OUT, .polarity = 0},
     {.pin_num = LED3, .direction = GPIO_OUT, .polarity = 0},
+#if CS_DECODER
+    {.pin_num = SPI_COM_A0, .direction = GPIO_OUT, .polarity = 0},
+    {.pin_num = SPI_COM_A0 + 1, .direction = GPIO_OUT, .polarity = 0},
+    {.pin_num = SPI_COM_A0 + 2, .direction = GPIO_OUT, .polarity = 0},
+    {.pin_num = SPI_COM_A0 + 3, .direction = GPIO_OUT, .polarity = 0},
+    {.pin_num = SPI_COM_CS_EN, .direction = GPIO_OUT, .polarity = 1},
+#else
     {.pin_num = SPI_COM_CS0, .direction = GPIO_OUT, .polarity = 1},
     {.pin_num = SPI_COM_CS1, .direction = GPIO_OUT, .polarity = 1},
     {.pin_num = SPI_COM_CS2, .direction = GPIO_OUT, .polarity = 1},
     {.pin_num = SPI_COM_CS3, .direction = GPIO_OUT, .polarity = 1},
+#endif
     {.pin_num = SPI_TFT_CS, .direction = GPIO_OUT, .polarity = 1},
     {.pin_num = SPI_TFT_DC, .direction = GPIO_OUT, .polarity = 0},
     {.pin_num = SPI_TFT_RST, .direction = GPIO_OUT, .polarity = 0},
-    {.pin_num = BTN_IN, .direction = GPIO_IN, .polarity = 0}
+    {.pin_num = BTN_IN, .direction = GPIO_IN, .polarity = 0},
+    {.pin_num = SYNC_OUT, .direction = GPIO_OUT, .polarity = 0}
 };
 
-uint32_t time_now       = 0;
-uint32_t time_last      = 0;
-
 bool btn_now            = 0;
 bool btn_last           = 0;
 uint btn_counter        = 0;
 
-Mode mode_now           = 0;
+volatile Mode mode_now  = 0;      // written by core1 once a switch is through
 Mode mode_next          = 0;
 uint mode_switch_cnt    = 0;
+uint page_first         = 0;    // sub on the first line, core1 only
+uint page_count         = NUM_ROWS; // subs the pages run through
+uint page_renders       = 0;
 
-uint tare_flag = 0;
-uint8_t out_buf[BUF_LEN] = { 'N', 'O', 'N', 'E' };
 char disp_buf[10];
 
+const char *const boot_phase_names[NUM_BOOT_PHASES] = { "hw", "first read", "tft", "first frame" };
+uint32_t boot_time_us[NUM_BOOT_PHASES];
+bool boot_reported = false;
+
+// Display state handed from core0 to core1. core0 fills it after every
+// poll round, core1 copies it out and draws from its own copy, so a slow
+// frame never holds up the polls. Both only touch it inside the lock.
+typedef struct DisplaySnapshot_t {
+    SubModule subs[NUM_SUBS];
+    Metrics_t metrics;
+    Mode mode_next;
+    bool recording;
+    bool fresh;             // not taken by core1 yet
+} DisplaySnapshot_t;
+DisplaySnapshot_t snapshot;
+critical_section_t snapshot_lock;
+
+// derived from the newest set of samples, new ones are in once a sub
+// delivered a weight or went absent
+Metrics_t metrics;
+volatile bool samples_new = true;
+
+char console_line[24];
+uint8_t console_line_len = 0;
+
+const uint link_rates[NUM_LINK_RATES] = {
+    100 * 1000, 250 * 1000, 500 * 1000, 1000 * 1000, 2000 * 1000, 4000 * 1000, 8000 * 1000,
+    12000 * 1000, 16000 * 1000
+};
+Settings_t settings;
+
+// one transaction per sub in flight, the buffers belong to the DMA until it is done
+typedef struct SubPoll_t {
+    uint8_t out[LINK_BURST_MAX_LEN];
+    uint8_t in[LINK_BURST_MAX_LEN];
+    volatile bool busy;
+    bool cmd_out;           // the command of the sub goes out with this frame
+    uint8_t seq;
+    uint8_t burst;          // burst block clocked in with this frame
+} SubPoll_t;
+SubPoll_t polls[NUM_SUBS];
+LoadCurve_t curves[NUM_SUBS];
+uint8_t latch_num = 0;
+
 void init_pins();
 void init_hw();
 void init_tft();
-void read_sub(uint sub_num);
+void poll_subs(uint arg);
+void poll_start(uint sub_num);
+void poll_done(uint sub_num);
+bool sense_sub(const SubModule *sub);
+void sub_select(uint cs, bool select);
+void print_scan();
+void print_metrics();
+void record_sample(uint sub_num, uint32_t age_us, int32_t grams, uint8_t flags);
+void toggle_recorder();
+void tare_all();
+void set_link(SubModule *sub, SubLink link);
+void print_links();
+void print_status();
+void update_tare(SubModule *sub, uint8_t flags);
+void send_command(uint sub_num, const LinkFrame_t *cmd);
+void read_console();
+void link_transfer(SubModule *sub, const uint8_t *out_buf, uint8_t *in_buf, uint len);
+uint burst_capacity(const SubModule *sub);
+void show_sample(SubModule *sub, int32_t grams, uint8_t flags);
+void sync_latch();
+void print_sync();
+bool read_burst(uint sub_num, const LinkFrame_t *rsp, const uint8_t *block, uint asked);
+void print_curve(uint sub_num);
+uint link_test(SubModule *sub, uint frames);
+void train_links();
+void train_link(uint sub_num);
+bool link_trained(uint sub_num);
+void train_new_links();
+void save_settings();
+void read_settings();
 void scan_button();
 void print_KG();
 void print_percent();
 void print_cross();
+void core1_entry();
+void report_boot();
+void render(SubModule subs[], const Metrics_t *metrics, Mode mode_next);
+void turn_page(SubModule subs[], const Metrics_t *metrics);
+uint page_rows();
+void publish_snapshot(uint arg);
+bool take_snapshot(SubModule subs[], Metrics_t *metrics, Mode *mode_next, bool *recording);
+void task_button(uint arg);
+void task_console(uint arg);
+void task_sync(uint arg);
+void task_record(uint arg);
+void task_stream(uint arg);
+
+// Task table in priority order. All subs are read once every 200 ms and
+// handed to core1 for drawing once their transactions are through. The
+// recorder writes to flash in the quiet time after that.
+#define NUM_TASKS   7
+Task_t tasks[NUM_TASKS] = {
+    { .name = "poll",    .run = poll_subs,    .arg = 0, .period_us = 200000, .phase_us = 1000,  .deadline_us = 500 },
+    { .name = "sync",    .run = task_sync,    .arg = 0, .period_us = 200000, .phase_us = SYNC_SLOT_US, .deadline_us = 500 },
+    { .name = "publish", .run = publish_snapshot, .arg = 0, .period_us = 200000, .phase_us = 9000, .deadline_us = 5000 },
+    { .name = "record",  .run = task_record,  .arg = 0, .period_us = 200000, .phase_us = 20000, .deadline_us = 5000 },
+    { .name = "button",  .run = task_button,  .arg = 0, .period_us = 100000, .phase_us = 0,     .deadline_us = 5000 },
+    { .name = "stream",  .run = task_stream,  .arg = 0, .period_us = 5000,   .phase_us = 2500,  .deadline_us = 5000 },
+    { .name = "console", .run = task_console, .arg = 0, .period_us = 10000,  .phase_us = 500,   .deadline_us = 10000 }
+};
 
 int main() {
     // Enable UART so we can print
     stdio_init_all();
 
     init_hw();
+    boot_time_us[kBootHw] = time_us_32();
 
-    init_tft();
+    // core1 owns the display, its init sequence takes most of a second
+    // while this core already polls the subs
+    critical_section_init(&snapshot_lock);
+    multicore_launch_core1(core1_entry);
 
+    sched_init(tasks, NUM_TASKS);
     while (1) {
-        time_now = time_us_32() / 1000;
+        sched_run_once();
+    }
+}
 
-        if (time_now != time_last) {
-            if ((time_now % 100) == 0) {
-                scan_button();
-            }
-            if ((time_now % 200) == 0) {
-                if (tare_flag == 1) {
-                    strncpy(out_buf, "TARE", 4);
-                    /*
-                    out_buf[0] = 'T';
-                    out_buf[1] = 'A';
-                    out_buf[2] = 'R';
-                    out_buf[3] = 'E';
-                    */
-                    tare_flag = 2;
-                } else if (tare_flag == 2) {
-                    strncpy(out_buf, "NONE", 4);
-                    /*
-                    out_buf[0] = 'N';
-                    out_buf[1] = 'O';
-                    out_buf[2] = 'N';
-                    out_buf[3] = 'E';
-                    */
-                    tare_flag = 0;
-                }
-            }
-            if ((time_now % 200) == 1) {
-                read_sub(0);
-            }
-            if ((time_now % 200) == 3) {
-                read_sub(1);
-            }
-            if ((time_now % 200) == 5) {
-                read_sub(2);
+// lines on the current page
+uint page_rows() {
+    uint rows = page_count - page_first;
+    return (rows > NUM_ROWS) ? NUM_ROWS : rows;
+}
+
+// Page through the subs counted by the metrics, up to the highest one
+// found. Every page stays on screen for PAGE_RENDERS frames.
+void turn_page(SubModule subs[], const Metrics_t *metrics) {
+    uint count = metrics->count;
+    uint first = page_first;
+    if (++page_renders >= PAGE_RENDERS) {
+        page_renders = 0;
+        first += NUM_ROWS;
+    }
+    if (first >= count) {
+        first = 0;
+    }
+    if ((first != page_first) || (count != page_count)) {
+        page_first = first;
+        page_count = count;
+        print_normal_numbers(disp_buf, page_first, page_rows());
+        unfreeze_all(subs);
+    }
+}
+
+// Draw the weights in the current mode. Runs on core1 from its own copy
+// of the sub states, mode_next is the mode core0 asks for.
+void render(SubModule subs[], const Metrics_t *metrics, Mode mode_next) {
+    if ((mode_now != kCross) && (mode_switch_cnt == 0)) {
+        turn_page(subs, metrics);
+    }
+    switch (mode_now) {
+    case kKilogram:
+        if (mode_next == kPercent) {
+            mode_switch_cnt++;
+            if (mode_switch_cnt == 1) {
+                //draw rectangle to indicate switch to percent mode
+                draw_mode_indicator_text(mode_next);
+            } else if (mode_switch_cnt > 10) {
+                //clear rectangle after time has elapsed
+                clear_mode_indicator_text(mode_next);
+                //move the mode indication bar to the correct position for next mode
+                set_mode_indicator_bar(mode_next);
+                unfreeze_all(subs);
+                mode_now = kPercent;
+                mode_switch_cnt = 0;
             }
-            if ((time_now % 200) == 7) {
-                read_sub(3);
+        } else {
+            print_KG(subs, page_first, page_rows(), disp_buf);
+        }
+        break;
+
+    case kPercent:
+        if (mode_next == kCross) {
+            mode_switch_cnt++;
+            if (mode_switch_cnt == 1) {
+                //draw rectangle to indicate switch to cross mode
+                draw_mode_indicator_text(mode_next);
+            } else if (mode_switch_cnt > 10) {
+                //clear rectangle after time has elapsed
+                clear_mode_indicator_text(mode_next);
+                //move the mode indication bar to the correct position for next mode
+                set_mode_indicator_bar(mode_next);
+                print_cross_numbers(disp_buf);
+                unfreeze_all(subs);
+                mode_now = kCross;
+                mode_switch_cnt = 0;
             }
-            if ((time_now % 200) == 9) {
-                switch (mode_now) {
-                case kKilogram:
-                    if (mode_next == kPercent) {
-                        mode_switch_cnt++;
-                        if (mode_switch_cnt == 1) {
-                            //draw rectangle to indicate switch to percent mode
-                            draw_mode_indicator_text(mode_next);
-                        } else if (mode_switch_cnt > 10) {
-                            //clear rectangle after time has elapsed
-                            clear_mode_indicator_text(mode_next);
-                            //move the mode indication bar to the correct position for next mode
-                            set_mode_indicator_bar(mode_next);
-                            mode_now = kPercent;
-                            mode_switch_cnt = 0;
-                        }
-                    } else {
-                        print_KG(sub_modules, disp_buf);
-                    }
-                    break;
-
-                case kPercent:
-                    if (mode_next == kCross) {
-                        mode_switch_cnt++;
-                        if (mode_switch_cnt == 1) {
-                            //draw rectangle to indicate switch to cross mode
-                            draw_mode_indicator_text(mode_next);
-                        } else if (mode_switch_cnt > 10) {
-                            //clear rectangle after time has elapsed
-                            clear_mode_indicator_text(mode_next);
-                            //move the mode indication bar to the correct position for next mode
-                            set_mode_indicator_bar(mode_next);
-                            print_cross_numbers(disp_buf);
-                            mode_now = kCross;
-                            mode_switch_cnt = 0;
-                        }
-                    } else {
-                        print_percent(sub_modules, disp_buf);
-                    }
-                    break;
-
-                case kCross:
-                    if (mode_next == kKilogram) {
-                        mode_switch_cnt++;
-                        if (mode_switch_cnt == 1) {
-                            //draw rectangle to indicate switch to kg mode
-                            draw_mode_indicator_text(mode_next);
-                        } else if (mode_switch_cnt > 10) {
-                            //clear rectangle after time has elapsed
-                            clear_mode_indicator_text(mode_next);
-                            //move the mode indication bar to the correct position for next mode
-                            set_mode_indicator_bar(mode_next);
-                            print_normal_numbers(disp_buf);
-                            mode_now = kKilogram;
-                            mode_switch_cnt = 0;
-                        }
-                    } else {
-                        print_cross(sub_modules, disp_buf);
-                    }
-                    break;
-
-                default:
-                    break;
-                }
+        } else {
+            print_percent(subs, metrics, page_first, page_rows(), disp_buf);
+        }
+        break;
+
+    case kCross:
+        if (mode_next == kKilogram) {
+            mode_switch_cnt++;
+            if (mode_switch_cnt == 1) {
+                //draw rectangle to indicate switch to kg mode
+                draw_mode_indicator_text(mode_next);
+            } else if (mode_switch_cnt > 10) {
+                //clear rectangle after time has elapsed
+                clear_mode_indicator_text(mode_next);
+                //move the mode indication bar to the correct position for next mode
+                set_mode_indicator_bar(mode_next);
+                page_first = 0;
+                page_renders = 0;
+                print_normal_numbers(disp_buf, page_first, page_rows());
+                unfreeze_all(subs);
+                mode_now = kKilogram;
+                mode_switch_cnt = 0;
             }
-            time_last = time_now;
+        } else {
+            print_cross(subs, metrics, disp_buf);
+        }
+        break;
+
+    default:
+        break;
+    }
+    if (boot_time_us[kBootFirstFrame] == 0) {
+        boot_time_us[kBootFirstFrame] = time_us_32();
+    }
+}
+
+// Hand the current sub states to core1, along with the metrics of the
+// samples that came in since the last time.
+void publish_snapshot(uint arg) {
+    critical_section_enter_blocking(&snapshot_lock);
+    if (samples_new) {
+        samples_new = false;
+        metrics_update(&metrics, sub_modules);
+        stream_set(to_ms_since_boot(get_absolute_time()), sub_modules, &metrics);
+    }
+    for (int i = 0; i < NUM_SUBS; i++) {
+        snapshot.subs[i] = sub_modules[i];
+        sub_modules[i].redraw = false;
+    }
+    snapshot.metrics = metrics;
+    snapshot.recording = recorder_running();
+    snapshot.mode_next = mode_next;
+    snapshot.fresh = true;
+    critical_section_exit(&snapshot_lock);
+    __sev();
+}
+
+// Copy the newest snapshot if there is one. Whether a value is frozen on
+// screen is only known to core1 and kept unless core0 asks for a redraw.
+bool take_snapshot(SubModule subs[], Metrics_t *metrics, Mode *mode_next, bool *recording) {
+    critical_section_enter_blocking(&snapshot_lock);
+    bool fresh = snapshot.fresh;
+    if (fresh) {
+        for (int i = 0; i < NUM_SUBS; i++) {
+            bool frozen = subs[i].frozen && !snapshot.subs[i].redraw;
+            subs[i] = snapshot.subs[i];
+            subs[i].frozen = frozen;
         }
+        *metrics = snapshot.metrics;
+        *mode_next = snapshot.mode_next;
+        *recording = snapshot.recording;
+        snapshot.fresh = false;
+    }
+    critical_section_exit(&snapshot_lock);
+    return fresh;
+}
+
+void task_button(uint arg) {
+    scan_button();
+}
+
+void task_console(uint arg) {
+    report_boot();
+    train_new_links();
+    print_status();
+    read_console();
+}
+
+void task_sync(uint arg) {
+    sync_latch();
+}
+
+void task_stream(uint arg) {
+    stream_task();
+}
+
+// a flash operation holds off the DMA interrupt, only start one between
+// two poll rounds
+void task_record(uint arg) {
+    if (!link_master_busy()) {
+        recorder_task();
     }
 }
 
@@ -221,11 +457,15 @@ void init_hw() {
 
     // Enable SPI 0 at 10kHz and connect to GPIOs
 
-    spi_init(SPI_COM_PORT, 100 * 1000);
+    read_settings();
+    spi_init(SPI_COM_PORT, LINK_BAUD_DEFAULT);
     spi_set_format(SPI_COM_PORT, 8, SPI_CPOL_1, SPI_CPHA_1, SPI_MSB_FIRST);
     gpio_set_function(SPI_COM_RX, GPIO_FUNC_SPI);
     gpio_set_function(SPI_COM_SCK, GPIO_FUNC_SPI);
     gpio_set_function(SPI_COM_TX, GPIO_FUNC_SPI);
+    // MISO reads low unless a selected sub drives it
+    gpio_pull_down(SPI_COM_RX);
+    link_master_init(SPI_COM_PORT, sub_select);
 
     spi_init(SPI_TFT_PORT, 10 * 1000 * 1000); // SPI with 10Mhz
     gpio_set_function(SPI_TFT_RX, GPIO_FUNC_SPI);
@@ -233,6 +473,13 @@ void init_hw() {
     gpio_set_function(SPI_TFT_TX, GPIO_FUNC_SPI);
 
     init_pins();
+    for (int i = 0; i < NUM_SUBS; i++) {
+        sub_modules[i].led_pin = (i < NUM_LEDS) ? sub_led_pins[i] : NO_LED;
+        sub_modules[i].cs = i;
+        curve_init(&curves[i]);
+    }
+    metrics_init(&metrics);
+    recorder_init();
 
     btn_last = gpio_get(BTN_IN);
 }
@@ -241,7 +488,6 @@ void init_tft() {
     TFT_RedTab_Initialize();
 
     setTextWrap(true);
-    TEST_DELAY1();
     fillScreen(ST7735_BLACK);
     setRotation(1);
     tft_width = 160;
@@ -252,38 +498,753 @@ void init_tft() {
     drawFastHLine(10, 94, 100, ST7735_WHITE);
     drawFastVLine(0, 0, 43, ST7735_WHITE);
 
-    print_normal_numbers(disp_buf);
+    print_normal_numbers(disp_buf, 0, NUM_ROWS);
 }
 
-void read_sub(uint sub_num) {
-    uint8_t in_buf[BUF_LEN];
+void core1_entry() {
+    static SubModule subs[NUM_SUBS];
+    static Metrics_t subs_metrics;
+    Mode next = kKilogram;
+    bool recording = false;
+    bool recording_shown = false;
 
-    assert(sub_num < 4);
+    // allow core0 to pause this core while it writes to flash
+    multicore_lockout_victim_init();
+    init_tft();
+    boot_time_us[kBootTft] = time_us_32();
+    while (1) {
+        // core0 sends an event with every snapshot
+        while (!take_snapshot(subs, &subs_metrics, &next, &recording)) {
+            __wfe();
+        }
+        render(subs, &subs_metrics, next);
+        if (recording != recording_shown) {
+            draw_record_indicator(recording);
+            recording_shown = recording;
+        }
+    }
+}
 
-    gpio_put(sub_modules[sub_num].cs_pin, 0);
+// print the boot timings once a terminal is attached
+void report_boot() {
+    if (boot_reported || !stdio_usb_connected()) {
+        return;
+    }
+    boot_reported = true;
+    printf("Boot:");
+    for (int i = 0; i < NUM_BOOT_PHASES; i++) {
+        printf(" %s %.1f ms", boot_phase_names[i], boot_time_us[i] / 1000.0f);
+    }
+    printf("\n");
+}
 
-    sleep_us(100);
+// Queue one transaction for every sub, the DMA runs them back to back
+// while the core goes on with other tasks. An absent sub only gets a frame
+// when its back-off ran out or it pulls MISO high once selected.
+void poll_subs(uint arg) {
+    bool poll[NUM_SUBS];
+    for (uint i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        poll[i] = !polls[i].busy;
+        if (poll[i] && (sub->link == kSubAbsent)) {
+            if (sub->probe_wait > 0) {
+                sub->probe_wait--;
+                // the bus must be free to select a sub on our own
+                poll[i] = !link_master_busy() && sense_sub(sub);
+            }
+        }
+    }
+    for (uint i = 0; i < NUM_SUBS; i++) {
+        if (poll[i]) {
+            poll_start(i);
+        }
+    }
+}
+
+// A sub drives MISO high as soon as chip select is low, with no sub there
+// the pull-down keeps it low. Takes a few us and no clock on the bus.
+bool sense_sub(const SubModule *sub) {
+    sub_select(sub->cs, true);
+    busy_wait_us_32(SUB_SENSE_US);
+    bool present = gpio_get(SPI_COM_RX);
+    sub_select(sub->cs, false);
+    return present;
+}
 
-    spi_write_read_blocking(SPI_COM_PORT, out_buf, in_buf, BUF_LEN);
+// Chip select of one sub, called from the DMA interrupt as well. The
+// decoder gets the new address while it is disabled, so no other sub sees
+// a glitch on its chip select.
+void __not_in_flash_func(sub_select)(uint cs, bool select) {
+#if CS_DECODER
+    if (select) {
+        gpio_put_masked(0xfu << SPI_COM_A0, cs << SPI_COM_A0);
+        gpio_put(SPI_COM_CS_EN, 0);
+    } else {
+        gpio_put(SPI_COM_CS_EN, 1);
+    }
+#else
+    gpio_put(sub_cs_pins[cs], !select);
+#endif
+}
 
-    sleep_us(100);
+void set_link(SubModule *sub, SubLink link) {
+    if (link == sub->link) {
+        return;
+    }
+    if (link == kSubAbsent) {
+        if (sub->led_pin != NO_LED) {
+            gpio_put(sub->led_pin, 0);
+        }
+        sub->grams = 0;
+        sub->result = 0.0f;
+        sub->stable = false;
+        sub->redraw = true;
+        // nobody there to tare or to command
+        sub->tare = kSubTareIdle;
+        sub->cmd_pending = false;
+        sub->cmd_in_flight = false;
+        sub->pending = 0;
+        sub->burst_expect = 0;
+        // the sub may have restarted with a new clock, take all it still buffers
+        sub->burst_acked = false;
+        sub->burst_rewind = true;
+        sub->burst_resync = false;
+        sub->latched = false;
+        sub->backoff = 1;
+        sub->probe_wait = 1;
+    }
+    sub->link = link;
+    samples_new = true;
+}
 
-    gpio_put(sub_modules[sub_num].cs_pin, 1);
+void poll_start(uint sub_num) {
+    SubModule *sub = &sub_modules[sub_num];
+    SubPoll_t *poll = &polls[sub_num];
+    LinkFrame_t frame = { 0 };
 
-    int temp_result_int = (in_buf[0] << 24) | (in_buf[1] << 16) | (in_buf[2] << 8) | in_buf[3];
+    assert(sub_num < NUM_SUBS);
+    link_put_read(&frame, latch_num + 1);
 
-    if (temp_result_int == 0) {
-        gpio_put(sub_modules[sub_num].led_pin, 0);
-        sub_modules[sub_num].result = 0.0f;
+    // The response to a frame only comes with the next transaction, so a
+    // command goes out every other read until it is acknowledged. With no
+    // command due, fetch the samples the sub buffered since the last read.
+    uint32_t interrupts = save_and_disable_interrupts();
+    poll->cmd_out = sub->cmd_pending && !sub->cmd_in_flight;
+    if (poll->cmd_out) {
+        frame = sub->cmd;
+    }
+    restore_interrupts(interrupts);
+    uint burst = burst_capacity(sub);
+    if (!poll->cmd_out && (burst > 0) && ((sub->pending > 0) || sub->burst_rewind)) {
+        LinkBurstCmd_t req = {
+            .count = burst,
+            .flags = sub->burst_acked ? LINK_BURST_ACK : 0,
+            .ack_us = sub->burst_ack_us,
+            .latch = latch_num + 1
+        };
+        if (sub->burst_rewind) {
+            req.flags |= LINK_BURST_REWIND;
+        }
+        link_put_burst_cmd(&frame, &req);
+    }
+    frame.seq = ++sub->seq;
+    if ((frame.cmd == kLinkCmdBurst) && sub->burst_rewind) {
+        sub->burst_rewind = false;
+        sub->burst_resync = true;
+        sub->burst_resync_seq = frame.seq;
+    }
+    poll->seq = frame.seq;
+    link_encode(&frame, poll->out);
+    // clock out the block asked for with the last frame
+    poll->burst = sub->burst_expect;
+    uint len = LINK_FRAME_LEN + poll->burst * LINK_BURST_SAMPLE_LEN;
+    memset(&poll->out[LINK_FRAME_LEN], 0, len - LINK_FRAME_LEN);
+    sub->burst_expect = (frame.cmd == kLinkCmdBurst) ? burst : 0;
+
+    LinkXfer_t xfer = {
+        .cs = sub->cs,
+        .baudrate = sub->baudrate,
+        .out = poll->out,
+        .in = poll->in,
+        .len = len,
+        .gap_us = 0,
+        .done = poll_done,
+        .arg = sub_num
+    };
+    poll->busy = true;
+    if (!link_master_queue(&xfer)) {
+        poll->busy = false;
+    }
+}
+
+// Runs from the DMA interrupt once the transaction of a sub is over.
+void poll_done(uint sub_num) {
+    SubModule *sub = &sub_modules[sub_num];
+    SubPoll_t *poll = &polls[sub_num];
+    LinkFrame_t rsp;
+
+    poll->busy = false;
+    LinkResult result = link_decode(poll->in, &rsp);
+    if ((result == kLinkOk) && sub->cmd_in_flight && (rsp.seq == sub->cmd_seq)) {
+        sub->cmd_pending = false;
+        if ((sub->cmd.cmd == kLinkCmdTare) && (sub->tare == kSubTareRequested)) {
+            // the acknowledging frame was put together before the sub started
+            sub->tare = kSubTareAcked;
+            sub->tare_us = time_us_32();
+        }
+    }
+    sub->cmd_in_flight = poll->cmd_out;
+    sub->cmd_seq = poll->seq;
+    // the sub still holds a block that did not arrive, ask for it again
+    if ((poll->burst > 0) && ((result != kLinkOk) || (rsp.cmd != kLinkRspBurst))) {
+        sub->burst_rewind = true;
+    }
+
+    if (result == kLinkEmpty) {
+        sub->frames_empty++;
+        if (sub->link_fails < 0xff) sub->link_fails++;
+        sub->good_run = 0;
+        if (sub->link == kSubAbsent) {
+            // still gone, wait twice as long for the next probe
+            uint backoff = (sub->backoff > 0) ? sub->backoff * 2 : 1;
+            sub->backoff = (backoff > SUB_BACKOFF_MAX) ? SUB_BACKOFF_MAX : backoff;
+            sub->probe_wait = sub->backoff;
+        } else if (sub->link_fails >= SUB_ABSENT_FAILS) {
+            set_link(sub, kSubAbsent);
+        }
+        return;
+    } else if (result != kLinkOk) {
+        // keep showing the last good value rather than a wrong one
+        sub->link_errors++;
+        if (sub->link_fails < 0xff) sub->link_fails++;
+        sub->good_run = 0;
+        set_link(sub, kSubDegraded);
+        return;
+    }
+
+    sub->frames_ok++;
+    sub->link_fails = 0;
+    if (sub->good_run < 0xff) sub->good_run++;
+    if ((sub->link == kSubAbsent) || ((sub->link == kSubDegraded) && (sub->good_run >= SUB_RECOVER_FRAMES))) {
+        set_link(sub, kSubPresent);
+        if (!sub->train_tried && !link_trained(sub_num)) {
+            sub->train_due = true;
+        }
+    }
+
+    if (rsp.cmd == kLinkRspSample) {
+        int32_t grams;
+        uint8_t flags;
+        link_get_sample(&rsp, &grams, &flags, &sub->age_ms, &sub->pending);
+        if (burst_capacity(sub) == 0) {
+            record_sample(sub_num, sub->age_ms * 1000, grams, flags);
+        }
+        // a sub that answers latches only shows the latched weights
+        if (sub->latched) {
+            update_tare(sub, flags);
+        } else {
+            show_sample(sub, grams, flags);
+        }
+        if ((boot_time_us[kBootFirstRead] == 0) && !(flags & LINK_FLAG_TARE_BUSY)) {
+            boot_time_us[kBootFirstRead] = time_us_32();
+        }
+    } else if (rsp.cmd == kLinkRspLatched) {
+        int32_t grams;
+        uint8_t flags;
+        if (link_get_latched(&rsp, &grams, &flags, &sub->latch_num, &sub->latch_skew_us)) {
+            sub->latched = true;
+            if (burst_capacity(sub) == 0) {
+                record_sample(sub_num, 0, grams, flags);
+            }
+            show_sample(sub, grams, flags);
+        }
+    } else if ((rsp.cmd == kLinkRspBurst) && (poll->burst > 0)) {
+        if (!read_burst(sub_num, &rsp, &poll->in[LINK_FRAME_LEN], poll->burst)) {
+            sub->burst_rewind = true;
+        }
+    } else if (rsp.cmd == kLinkRspStatus) {
+        // printed by the console task, not from the interrupt
+        sub->status_new = link_get_status(&rsp, &sub->status);
+    }
+
+    if ((sub->result > 240.0) || (-100 > sub->result)) {
+        sub->grams = 0;
+        sub->result = 0.0f;
+        sub->oor_flag = true;
+    }
+}
+
+// link quality per corner
+void print_links() {
+    const char *const names[] = { "absent", "present", "degraded" };
+    for (int i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        uint total = sub->frames_ok + sub->frames_empty + sub->link_errors;
+        printf("Sub %d: %s at %u kHz, %u good, %u empty, %u broken (%.2f %%)", i + 1, names[sub->link],
+               sub->baudrate / 1000, sub->frames_ok, sub->frames_empty, sub->link_errors,
+               (total > 0) ? 100.0f * sub->link_errors / total : 0.0f);
+        if (sub->link == kSubAbsent) {
+            printf(", next probe in %d rounds", sub->probe_wait);
+        }
+        printf("\n");
+    }
+}
+
+// Probe every absent sub with the next poll round and list the ones that
+// answer so far. The display pages through all subs up to the highest one
+// found.
+void print_scan() {
+    bool present[NUM_SUBS];
+    uint found = 0;
+    uint32_t interrupts = save_and_disable_interrupts();
+    for (int i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        present[i] = (sub->link != kSubAbsent);
+        if (!present[i]) {
+            sub->backoff = 1;
+            sub->probe_wait = 0;
+        }
+    }
+    restore_interrupts(interrupts);
+    // USB output can block, print with the interrupts on again
+    printf("Subs:");
+    for (int i = 0; i < NUM_SUBS; i++) {
+        if (present[i]) {
+            printf(" %d", i + 1);
+            found++;
+        }
+    }
+    printf(" (%u of %d found), probing the others\n", found, NUM_SUBS);
+}
+
+// the metrics handed to core1 with the last snapshot, in % of the total
+void print_metrics() {
+    Metrics_t m = metrics;
+    const float scale = METRICS_SCALE / 100.0f;
+    printf("Metrics %lu: %.3f kg over %d subs%s\n", (unsigned long)m.version, m.total_g / GRAMS_PER_KG, m.count,
+           m.valid ? "" : " (not valid)");
+    for (int i = 0; i < m.count; i++) {
+        printf("Sub %d: %.1f %%\n", i + 1, m.share[i] / scale);
+    }
+    printf("Corners %.3f kg%s: front %.1f, rear %.1f, left %.1f, right %.1f, FL+RR %.1f, FR+RL %.1f\n",
+           m.corners_g / GRAMS_PER_KG, m.corners_valid ? "" : " (not valid)", m.front / scale, m.rear / scale,
+           m.left / scale, m.right / scale, m.cross_flrr / scale, m.cross_frrl / scale);
+    printf("CoG: %.1f %% of the wheelbase behind the front axle, %.1f %% of the track right of center\n",
+           m.cog_long / scale, m.cog_lat / scale);
+}
+
+// status frames the subs sent since the last call
+void print_status() {
+    for (int i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        if (!sub->status_new) {
+            continue;
+        }
+        sub->status_new = false;
+        LinkStatus_t status = sub->status;
+        printf("Sub %d: protocol %d, HX1 %d SPS, HX2 %d SPS, tare %d, link errors %d/%u, lost samples %d, age %d ms\n",
+               i + 1, status.version, status.rate_sps[0], status.rate_sps[1], status.tare_state,
+               status.link_errors, sub->link_errors, status.overflows, sub->age_ms);
+    }
+}
+
+// Samples of a burst go to the curve of the sub, the newest one also to
+// the display. The block only counts if its CRC matches, returns false
+// otherwise. Blocks the sub built before a rewind are skipped, their
+// samples come again, and samples up to the last acknowledged one are
+// not taken twice.
+bool read_burst(uint sub_num, const LinkFrame_t *rsp, const uint8_t *block, uint asked) {
+    SubModule *sub = &sub_modules[sub_num];
+    LinkBurst_t burst;
+    LinkBurstSample_t sample;
+
+    if (!link_get_burst(rsp, &burst) || (burst.count > asked) ||
+        (link_crc16(block, asked * LINK_BURST_SAMPLE_LEN) != burst.block_crc)) {
+        sub->link_errors++;
+        return false;
+    }
+    if (sub->burst_resync) {
+        if ((int8_t)(rsp->seq - sub->burst_resync_seq) < 0) {
+            return true;
+        }
+        sub->burst_resync = false;
+    }
+    sub->pending = burst.pending;
+    if (burst.count == 0) {
+        return true;
+    }
+    for (uint i = 0; i < burst.count; i++) {
+        link_get_burst_sample(block, i, &sample);
+        if (sub->burst_acked && ((int32_t)(sample.time_us - sub->burst_ack_us) <= 0)) {
+            continue;
+        }
+        CurvePoint_t point = { .grams = sample.grams, .time_us = sample.time_us, .flags = sample.flags };
+        curve_add(&curves[sub_num], &point);
+        record_sample(sub_num, burst.now_us - sample.time_us, sample.grams, sample.flags);
+        sub->burst_ack_us = sample.time_us;
+        sub->burst_acked = true;
+    }
+    uint32_t age_ms = (burst.now_us - sample.time_us) / 1000;
+    sub->age_ms = (age_ms > 0xffff) ? 0xffff : age_ms;
+    if (sub->latched) {
+        update_tare(sub, sample.flags);
     } else {
-        gpio_xor_mask(1 << sub_modules[sub_num].led_pin);
-        sub_modules[sub_num].result = (float)((~temp_result_int) / KG_CALIB_FACTOR);
-        sub_modules[sub_num].oor_flag = false;
+        show_sample(sub, sample.grams, sample.flags);
     }
+    return true;
+}
+
+// Every sample goes to the recorder and the USB stream once: the burst
+// samples, or the read ones for a sub whose link is too slow for bursts.
+// Time is head time, the age is taken off.
+void record_sample(uint sub_num, uint32_t age_us, int32_t grams, uint8_t flags) {
+    uint32_t time_ms = to_ms_since_boot(get_absolute_time()) - age_us / 1000;
+    recorder_add(sub_num, time_ms, grams, flags);
+    stream_sample(sub_num, time_ms, grams, flags);
+}
+
+// weight of a sub for the display
+void show_sample(SubModule *sub, int32_t grams, uint8_t flags) {
+    if (sub->led_pin != NO_LED) {
+        gpio_xor_mask(1 << sub->led_pin);
+    }
+    sub->grams = grams;
+    sub->result = (float)grams / GRAMS_PER_KG;
+    sub->stable = (flags & LINK_FLAG_STABLE) != 0;
+    sub->oor_flag = false;
+    update_tare(sub, flags);
+    samples_new = true;
+}
 
-    if ((sub_modules[sub_num].result > 240.0) || (-100 > sub_modules[sub_num].result)) {
-        sub_modules[sub_num].result = 0.0f;
-        sub_modules[sub_num].oor_flag = true;
+// All subs see the edge at the same time and answer with their weight at
+// that instant on the next read. The reads since the last edge told them
+// its number. A read still on the bus would arrive after the edge with
+// the old number, the latch waits for the next slot then.
+void sync_latch() {
+    if (link_master_busy()) {
+        return;
+    }
+    gpio_put(SYNC_OUT, 1);
+    sleep_us(SYNC_PULSE_US);
+    gpio_put(SYNC_OUT, 0);
+    latch_num++;
+}
+
+// Skew of the last latched weights: how far each sub was off the latch and
+// the spread between the corners that answered the same latch.
+void print_sync() {
+    int min_skew = INT16_MAX;
+    int max_skew = INT16_MIN;
+    uint8_t last = 0;
+    bool found = false;
+    printf("Last latch sent: %d\n", latch_num);
+    for (int i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        if (sub->latched && (!found || (int8_t)(sub->latch_num - last) > 0)) {
+            last = sub->latch_num;
+            found = true;
+        }
+    }
+    for (int i = 0; i < NUM_SUBS; i++) {
+        SubModule *sub = &sub_modules[i];
+        if (!sub->latched) {
+            printf("Sub %d: no latch\n", i + 1);
+            continue;
+        }
+        printf("Sub %d: latch %d, skew %d us%s\n", i + 1, sub->latch_num, sub->latch_skew_us,
+               (sub->latch_num == last) ? "" : " (old)");
+        if (sub->latch_num == last) {
+            if (sub->latch_skew_us < min_skew) min_skew = sub->latch_skew_us;
+            if (sub->latch_skew_us > max_skew) max_skew = sub->latch_skew_us;
+        }
+    }
+    if (found) {
+        printf("Residual skew between corners: %d us\n", max_skew - min_skew);
+    }
+}
+
+// Samples that fit into one burst at the clock of the sub, none at the
+// slowest clock where a burst would hold up the other subs too long.
+uint burst_capacity(const SubModule *sub) {
+    uint bytes = (uint)((uint64_t)sub->baudrate * LINK_BURST_TIME_US / 8000000);
+    if (bytes <= LINK_FRAME_LEN) {
+        return 0;
+    }
+    uint samples = (bytes - LINK_FRAME_LEN) / LINK_BURST_SAMPLE_LEN;
+    return (samples > LINK_BURST_MAX) ? LINK_BURST_MAX : samples;
+}
+
+// Blocking transaction at the clock trained for the sub, used by the link
+// training. Waits for the polls still on the bus.
+void link_transfer(SubModule *sub, const uint8_t *out_buf, uint8_t *in_buf, uint len) {
+    LinkXfer_t xfer = {
+        .cs = sub->cs,
+        .baudrate = sub->baudrate,
+        .out = out_buf,
+        .in = in_buf,
+        .len = len,
+        .gap_us = LINK_TRAIN_GAP_US
+    };
+    link_master_transfer(&xfer);
+}
+
+// Send echo frames with test patterns at the current clock of the sub and
+// count the bits of the echoes that differ from what was sent. The echo
+// of a frame comes with the next transaction. Returns LINK_NOT_TESTED if
+// the sub did not answer at all.
+uint link_test(SubModule *sub, uint frames) {
+    uint8_t out_buf[LINK_FRAME_LEN];
+    uint8_t in_buf[LINK_FRAME_LEN];
+    uint8_t expected[LINK_FRAME_LEN];
+    uint errors = 0;
+    uint empty = 0;
+
+    for (uint i = 0; i <= frames; i++) {
+        LinkFrame_t frame = { .cmd = kLinkCmdEcho, .len = LINK_MAX_PAYLOAD };
+        for (uint j = 0; j < LINK_MAX_PAYLOAD; j++) {
+            switch (i % 4) {
+            case 0:  frame.payload[j] = (j & 1) ? 0xaa : 0x55; break;     // toggling bits
+            case 1:  frame.payload[j] = (j & 1) ? 0x00 : 0xff; break;     // long runs
+            case 2:  frame.payload[j] = 1 << (j % 8); break;              // walking one
+            default: frame.payload[j] = (uint8_t)(i + j); break;
+            }
+        }
+        frame.seq = ++sub->seq;
+        link_encode(&frame, out_buf);
+        link_transfer(sub, out_buf, in_buf, LINK_FRAME_LEN);
+
+        if (i > 0) {
+            LinkFrame_t dummy;
+            if (link_decode(in_buf, &dummy) == kLinkEmpty) {
+                empty++;
+            }
+            for (uint j = 0; j < LINK_FRAME_LEN; j++) {
+                uint8_t diff = in_buf[j] ^ expected[j];
+                while (diff) {
+                    errors += diff & 1;
+                    diff >>= 1;
+                }
+            }
+        }
+        // what the sub has to send back next time
+        frame.cmd = kLinkRspEcho;
+        link_encode(&frame, expected);
+    }
+    return (empty == frames) ? LINK_NOT_TESTED : errors;
+}
+
+// Step the link clock of every sub up until the echo test shows bit
+// errors and keep the fastest clock without any. Subs that do not answer
+// keep their clock. The results are stored in flash.
+void train_links() {
+    for (int i = 0; i < NUM_SUBS; i++) {
+        train_link(i);
+    }
+    save_settings();
+}
+
+void train_link(uint sub_num) {
+    SubModule *sub = &sub_modules[sub_num];
+    uint best = 0;
+    sub->train_tried = true;
+    for (int r = 0; r < NUM_LINK_RATES; r++) {
+        settings.link_bit_errors[sub_num][r] = LINK_NOT_TESTED;
+    }
+    for (int r = 0; r < NUM_LINK_RATES; r++) {
+        sub->baudrate = link_rates[r];
+        uint errors = link_test(sub, LINK_TRAIN_FRAMES);
+        if (errors == LINK_NOT_TESTED) {
+            break;
+        }
+        settings.link_bit_errors[sub_num][r] = (errors > 0xfffe) ? 0xfffe : errors;
+        printf("Sub %d at %u kHz: %u bit errors\n", sub_num + 1, link_rates[r] / 1000, errors);
+        if (errors > 0) {
+            break;
+        }
+        best = link_rates[r];
+    }
+    if (best > 0) {
+        settings.link_baud[sub_num] = best;
+    }
+    sub->baudrate = settings.link_baud[sub_num];
+    printf("Sub %d: link at %u kHz\n", sub_num + 1, sub->baudrate / 1000);
+}
+
+// true once a training got an answer from the sub
+bool link_trained(uint sub_num) {
+    for (int r = 0; r < NUM_LINK_RATES; r++) {
+        if (settings.link_bit_errors[sub_num][r] != LINK_NOT_TESTED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// An untrained sub stays at the slowest clock, too slow for bursts. Train
+// every sub that showed up without a result once, here and not in the
+// DMA interrupt that found it.
+void train_new_links() {
+    bool trained = false;
+    for (int i = 0; i < NUM_SUBS; i++) {
+        if (sub_modules[i].train_due) {
+            sub_modules[i].train_due = false;
+            train_link(i);
+            trained = true;
+        }
+    }
+    if (trained) {
+        save_settings();
+    }
+}
+
+// queue a command for a sub, replaces one that was not acknowledged yet
+void send_command(uint sub_num, const LinkFrame_t *cmd) {
+    // the DMA interrupt clears cmd_pending once the old one is acknowledged
+    uint32_t interrupts = save_and_disable_interrupts();
+    sub_modules[sub_num].cmd = *cmd;
+    sub_modules[sub_num].cmd_pending = true;
+    restore_interrupts(interrupts);
+}
+
+// USB terminal: "status", "rate <sub> <sps>" (sub 0 = all), "train", "curve <sub>", "sync", "tasks", "links", "scan", "metrics",
+// "record", "dump [session]" and "stream [on|off]"
+void read_console() {
+    int c = getchar_timeout_us(0);
+    if ((c == PICO_ERROR_TIMEOUT) || (c == '\n')) {
+        return;
+    }
+    if ((c == 8) && (console_line_len > 0)) {
+        console_line[--console_line_len] = '\0';
+        return;
+    }
+    if (c != '\r') {
+        if ((c >= ' ') && (c <= '~') && (console_line_len < sizeof(console_line) - 1)) {
+            console_line[console_line_len++] = c;
+            console_line[console_line_len] = '\0';
+        }
+        return;
+    }
+
+    LinkFrame_t cmd = { 0 };
+    int sub_num, sps;
+    if (strcmp(console_line, "status") == 0) {
+        cmd.cmd = kLinkCmdStatus;
+        for (int i = 0; i < NUM_SUBS; i++) {
+            send_command(i, &cmd);
+        }
+    } else if ((sscanf(console_line, "rate %d %d", &sub_num, &sps) == 2) && (sub_num >= 0) && (sub_num <= NUM_SUBS)) {
+        link_put_set_rate(&cmd, 0, sps);
+        for (int i = 0; i < NUM_SUBS; i++) {
+            if ((sub_num == 0) || (sub_num == i + 1)) {
+                send_command(i, &cmd);
+            }
+        }
+    } else if (strcmp(console_line, "train") == 0) {
+        train_links();
+    } else if ((sscanf(console_line, "curve %d", &sub_num) == 1) && (sub_num >= 1) && (sub_num <= NUM_SUBS)) {
+        print_curve(sub_num - 1);
+    } else if (strcmp(console_line, "sync") == 0) {
+        print_sync();
+    } else if (strcmp(console_line, "tasks") == 0) {
+        sched_print();
+    } else if (strcmp(console_line, "links") == 0) {
+        print_links();
+    } else if (strcmp(console_line, "scan") == 0) {
+        print_scan();
+    } else if (strcmp(console_line, "metrics") == 0) {
+        print_metrics();
+    } else if (strcmp(console_line, "record") == 0) {
+        toggle_recorder();
+        recorder_print();
+    } else if (strcmp(console_line, "dump") == 0) {
+        recorder_dump(-1);
+    } else if ((sscanf(console_line, "dump %d", &sub_num) == 1) && (sub_num >= 0)) {
+        recorder_dump(sub_num);
+    } else if (strcmp(console_line, "stream on") == 0) {
+        stream_start();
+    } else if (strcmp(console_line, "stream off") == 0) {
+        stream_stop();
+        stream_print();
+    } else if (strcmp(console_line, "stream") == 0) {
+        stream_print();
+    } else {
+        printf("Commands: \"status\", \"rate <sub> <sps>\" (sub 0 = all), \"train\", \"curve <sub>\", \"sync\", \"tasks\", \"links\", \"scan\", \"metrics\", \"record\", \"dump [session]\", \"stream [on|off]\"\n");
+    }
+    console_line_len = 0;
+    console_line[0] = '\0';
+}
+
+// dump the load curve of a sub as CSV, time relative to the oldest point
+void print_curve(uint sub_num) {
+    CurvePoint_t point;
+    uint32_t start = 0;
+    printf("time_ms,kg,flags\n");
+    for (uint i = 0; curve_get(&curves[sub_num], i, &point); i++) {
+        if (i == 0) {
+            start = point.time_us;
+        }
+        printf("%lu,%.3f,%d\n", (unsigned long)((point.time_us - start) / 1000), point.grams / GRAMS_PER_KG, point.flags);
+    }
+}
+
+// Once the sub acknowledged the tare command, wait until it reports the
+// tare as running and then as finished. The flags of frames and burst
+// samples from before the start still show the state of the last tare.
+void update_tare(SubModule *sub, uint8_t flags) {
+    switch (sub->tare) {
+    case kSubTareAcked:
+        if (flags & LINK_FLAG_TARE_BUSY) {
+            sub->tare = kSubTareBusy;
+        } else if ((time_us_32() - sub->tare_us) > SUB_TARE_START_US) {
+            sub->tare = kSubTareIdle;
+        }
+        break;
+    case kSubTareBusy:
+        if (!(flags & LINK_FLAG_TARE_BUSY)) {
+            // new zero, draw the value again even if it is frozen
+            sub->redraw = true;
+            sub->tare = kSubTareIdle;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// function to write and read settings to and from flash, same as on the sub
+void save_settings() {
+    static uint8_t page[((sizeof(Settings_t) / FLASH_PAGE_SIZE) + 1) * FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &settings, sizeof(settings));
+
+    // core1 runs from flash while drawing
+    bool lockout = multicore_lockout_victim_is_initialized(1);
+    if (lockout) {
+        multicore_lockout_start_blocking();
+    }
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(FLASH_TARGET_OFFSET, page, sizeof(page));
+    restore_interrupts(interrupts);
+    if (lockout) {
+        multicore_lockout_end_blocking();
+    }
+}
+
+void read_settings() {
+    const uint8_t *flash_target_contents = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET);
+    memcpy(&settings, flash_target_contents, sizeof(settings));
+    if (settings.magic != SETTINGS_MAGIC) {
+        settings.magic = SETTINGS_MAGIC;
+        for (int i = 0; i < NUM_SUBS; i++) {
+            settings.link_baud[i] = LINK_BAUD_DEFAULT;
+            for (int r = 0; r < NUM_LINK_RATES; r++) {
+                settings.link_bit_errors[i][r] = LINK_NOT_TESTED;
+            }
+        }
+    }
+    for (int i = 0; i < NUM_SUBS; i++) {
+        sub_modules[i].baudrate = settings.link_baud[i];
     }
 }
 
@@ -293,24 +1254,43 @@ void scan_button() {
         if (!btn_now) {             //button pressed
             btn_counter++;
         } else {                    //button released
-            if (btn_counter > 1) {
-                btn_counter = 0;
+            if (btn_counter > BTN_TARE_COUNT) {
+                tare_all();
+            } else if (btn_counter > 1) {
                 mode_next = mode_now + 1;
                 if (mode_next >= NUM_MODES) {
                     mode_next = 0;
                 }
             }
+            btn_counter = 0;
         }
     } else {
         if (!btn_now) {
             if (btn_counter > 0) {
                 btn_counter++;
             }
-            if (btn_counter > 20) {
-                tare_flag = 1;
+            // fires while held, the release after it does nothing
+            if (btn_counter > BTN_RECORD_COUNT) {
+                toggle_recorder();
                 btn_counter = 0;
             }
         }
     }
     btn_last = btn_now;
 }
+
+void tare_all() {
+    LinkFrame_t cmd = { .cmd = kLinkCmdTare, .len = 0 };
+    for (int i = 0; i < NUM_SUBS; i++) {
+        sub_modules[i].tare = kSubTareRequested;
+        send_command(i, &cmd);
+    }
+}
+
+void toggle_recorder() {
+    if (recorder_running() || recorder_queued()) {
+        recorder_stop();
+    } else if (!recorder_start()) {
+        printf("Recorder: last session still closing, the new one starts once it is written\n");
+    }
+}
@@ -1,8 +1,9 @@
 #include <stdio.h>
 #include "ST7735_TFT.h"
 #include "display_helpers.h"
+#include "metrics.h"
 
-uint8_t line_vertical_position[NUM_SUBS] = { 4, 36, 68, 100 };
+uint8_t line_vertical_position[NUM_ROWS] = { 4, 36, 68, 100 };
 
 // can be used to pad number outputs e.g. sprintf(disp_buf, "2: %*.1f", pad_left_calc(result_sub1), result_sub1);
 int pad_left_calc(float input) {
@@ -19,15 +20,22 @@ int pad_left_calc(float input) {
     return padding;
 }
 
-void print_normal_numbers(char disp_buf[]) {
-    sprintf(disp_buf, "1:");
-    drawText(5, 4, disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-    sprintf(disp_buf, "2:");
-    drawText(5, 36, disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-    sprintf(disp_buf, "3:");
-    drawText(5, 68, disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-    sprintf(disp_buf, "4:");
-    drawText(5, 100, disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
+// Number the lines with the subs first + 1 on, lines past rows are cleared.
+// Two digit numbers only fit in the smaller font.
+void print_normal_numbers(char disp_buf[], uint first, uint rows) {
+    for (uint i = 0; i < NUM_ROWS; i++) {
+        uint8_t row = line_vertical_position[i];
+        if (i >= rows) {
+            fillRect(5, row, 153, 24, ST7735_BLACK);
+        } else if (first + i + 1 < 10) {
+            sprintf(disp_buf, "%u:", first + i + 1);
+            drawText(5, row, disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
+        } else {
+            fillRect(5, row, 34, 24, ST7735_BLACK);
+            sprintf(disp_buf, "%u:", first + i + 1);
+            drawText(5, row + 4, disp_buf, ST7735_WHITE, ST7735_BLACK, 2);
+        }
+    }
 }
 
 void print_cross_numbers(char disp_buf[]) {
@@ -113,70 +121,108 @@ void set_mode_indicator_bar(Mode mode_next) {
     }
 }
 
-void print_KG(SubModule sub_modules[], char disp_buf[]) {
+// small green square right of a line while the reading is settled
+void draw_stable_indicator(uint8_t row, bool stable) {
+    fillRect(152, row + 9, 6, 6, stable ? ST7735_GREEN : ST7735_BLACK);
+}
+
+// small red square in the top right corner while the recorder runs
+void draw_record_indicator(bool recording) {
+    fillRect(152, 0, 6, 6, recording ? ST7735_RED : ST7735_BLACK);
+}
+
+// force a full redraw, e.g. after the mode changed
+void unfreeze_all(SubModule sub_modules[]) {
     for (int i = 0; i < NUM_SUBS; i++) {
-        if (sub_modules[i].oor_flag == true) {
+        sub_modules[i].frozen = false;
+    }
+}
+
+// true if the count subs from 0 on are stable and the lines of the page
+// starting at first are already on screen
+static bool all_frozen(SubModule sub_modules[], uint count, uint first, uint rows) {
+    for (uint i = 0; i < count; i++) {
+        if (!sub_modules[i].stable) {
+            return false;
+        }
+    }
+    for (uint i = first; i < first + rows; i++) {
+        if (!sub_modules[i].frozen) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// share in METRICS_SCALE as whole percent on line row
+static void print_share(uint row, int16_t share, char disp_buf[]) {
+    int percent = share / (METRICS_SCALE / 100);
+    sprintf(disp_buf, "%*s%d", pad_left_calc(percent) + 2, "", percent);
+    drawText(39, line_vertical_position[row], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
+}
+
+// one page of subs, line i shows sub first + i
+void print_KG(SubModule sub_modules[], uint first, uint rows, char disp_buf[]) {
+    for (uint i = 0; i < rows; i++) {
+        SubModule *sub = &sub_modules[first + i];
+        // keep a settled value frozen on screen
+        if (sub->stable && sub->frozen) {
+            continue;
+        }
+        if (sub->oor_flag == true) {
             drawText(39, line_vertical_position[i], "   OOR", ST7735_WHITE, ST7735_BLACK, 3);
         } else {
-            sprintf(disp_buf, "%*s%.1f", pad_left_calc(sub_modules[i].result), "", sub_modules[i].result);
+            sprintf(disp_buf, "%*s%.1f", pad_left_calc(sub->result), "", sub->result);
             drawText(39, line_vertical_position[i], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
         }
-
+        draw_stable_indicator(line_vertical_position[i], sub->stable);
+        sub->frozen = sub->stable;
     }
 }
 
-void print_percent(SubModule sub_modules[], char disp_buf[]) {
-    float result_sum    = 0.0f;
-    uint8_t oor_akk     = 0;
-
-    for (int i = 0; i < NUM_SUBS; i++) {
-        result_sum += sub_modules[i].result;
-        oor_akk    += (uint8_t)sub_modules[i].oor_flag;
+// one page of subs in percent of the total over all counted subs
+void print_percent(SubModule sub_modules[], const Metrics_t *metrics, uint first, uint rows, char disp_buf[]) {
+    // percentages depend on all pads, redraw unless all of them settled
+    if (all_frozen(sub_modules, metrics->count, first, rows)) {
+        return;
     }
-    if ((result_sum == 0) || (oor_akk > 0)) {
-        for (int i = 0; i < NUM_SUBS; i++) {
+    if (!metrics->valid) {
+        for (uint i = 0; i < rows; i++) {
             drawText(39, line_vertical_position[i], "    NA", ST7735_WHITE, ST7735_BLACK, 3);
         }
     } else {
-        for (int i = 0; i < NUM_SUBS; i++) {
-            int result_sub_percent = (int)((sub_modules[i].result * 100.0) / result_sum);
-            sprintf(disp_buf, "%*s%d", pad_left_calc(result_sub_percent) + 2, "", result_sub_percent);
-            drawText(39, line_vertical_position[i], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
+        for (uint i = 0; i < rows; i++) {
+            print_share(i, metrics->share[first + i], disp_buf);
         }
     }
+    for (uint i = 0; i < rows; i++) {
+        draw_stable_indicator(line_vertical_position[i], sub_modules[first + i].stable);
+        sub_modules[first + i].frozen = sub_modules[first + i].stable;
+    }
 }
 
-void print_cross(SubModule sub_modules[], char disp_buf[]) {
-    float result_sum    = 0.0f;
-    uint8_t oor_akk     = 0;
-
-    for (int i = 0; i < NUM_SUBS; i++) {
-        result_sum += sub_modules[i].result;
-        oor_akk    += (uint8_t)sub_modules[i].oor_flag;
+// front, rear and cross share of the four corners, the subs 1 to 4
+void print_cross(SubModule sub_modules[], const Metrics_t *metrics, char disp_buf[]) {
+    // every line combines several corners, redraw unless all of them settled
+    if (all_frozen(sub_modules, NUM_CORNERS, 0, NUM_ROWS)) {
+        return;
     }
-    if ((result_sum == 0) || (oor_akk > 0)) {
-        for (int i = 0; i < NUM_SUBS; i++) {
+    if (!metrics->corners_valid) {
+        for (int i = 0; i < NUM_ROWS; i++) {
             drawText(39, line_vertical_position[i], "    NA", ST7735_WHITE, ST7735_BLACK, 3);
         }
     } else {
-        //print front
-        int result_front = (int)(((sub_modules[kFL].result + sub_modules[kFR].result) * 100.0) / result_sum);
-        sprintf(disp_buf, "%*s%d", pad_left_calc(result_front) + 2, "", result_front);
-        drawText(39, line_vertical_position[0], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-
-        //print rear
-        int result_rear = (int)(((sub_modules[kRL].result + sub_modules[kRR].result) * 100.0) / result_sum);
-        sprintf(disp_buf, "%*s%d", pad_left_calc(result_rear) + 2, "", result_rear);
-        drawText(39, line_vertical_position[1], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-
-        //print cross FL+RR
-        int result_cross_FLRR = (int)(((sub_modules[kFL].result + sub_modules[kRR].result) * 100.0) / result_sum);
-        sprintf(disp_buf, "%*s%d", pad_left_calc(result_cross_FLRR) + 2, "", result_cross_FLRR);
-        drawText(39, line_vertical_position[2], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-
-        //print cross FR+RL
-        int result_cross_FRRL = (int)(((sub_modules[kFR].result + sub_modules[kRL].result) * 100.0) / result_sum);
-        sprintf(disp_buf, "%*s%d", pad_left_calc(result_cross_FRRL) + 2, "", result_cross_FRRL);
-        drawText(39, line_vertical_position[3], disp_buf, ST7735_WHITE, ST7735_BLACK, 3);
-    }
-}
\ No newline at end of file
+        print_share(0, metrics->front, disp_buf);
+        print_share(1, metrics->rear, disp_buf);
+        print_share(2, metrics->cross_flrr, disp_buf);
+        print_share(3, metrics->cross_frrl, disp_buf);
+    }
+    bool stable = true;
+    for (int i = 0; i < NUM_CORNERS; i++) {
+        stable = stable && sub_modules[i].stable;
+        sub_modules[i].frozen = sub_modules[i].stable;
+    }
+    for (int i = 0; i < NUM_ROWS; i++) {
+        draw_stable_indicator(line_vertical_position[i], stable);
+    }
+}
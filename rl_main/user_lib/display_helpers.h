@@ -5,14 +5,76 @@
 #ifndef DISPLAY_HELPER_H
 #define DISPLAY_HELPER_H
 
+#include "link_protocol.h"
+
 #define MAX_PADDING     3
+#define NUM_ROWS        4       // lines on the display
+
+// 1: chip selects of the subs come from a 4 to 16 decoder, 0: one pin per sub
+#define CS_DECODER      0
+
+#if CS_DECODER
+#define NUM_SUBS        16
+#else
 #define NUM_SUBS        4
+#endif
+#define NO_LED          0xff
+
+// tare handshake with one sub
+typedef enum SubTare {
+    kSubTareIdle        = 0,
+    kSubTareRequested   = 1,    // tare command sent until the sub acknowledges it
+    kSubTareBusy        = 2,    // sub is collecting, wait for it to finish
+    kSubTareAcked       = 3     // acknowledged, wait for the sub to report it busy
+} SubTare;
+
+// health of the link to one sub
+typedef enum SubLink {
+    kSubAbsent          = 0,    // no answer, probed with back-off
+    kSubPresent         = 1,
+    kSubDegraded        = 2     // answers, but frames were broken lately
+} SubLink;
 
 typedef struct SubModule {
-    uint led_pin;
-    uint cs_pin;
+    uint led_pin;       // NO_LED if the sub has none
+    uint cs;            // chip select line, decoder address or pin index
+    int32_t grams;      // calibrated weight, 0 while out of range
     float result;
     bool oor_flag;
+    bool stable;        // sub reports no motion on the pad
+    bool frozen;        // stable value is on screen, skip redrawing it
+    bool redraw;        // new zero, core1 has to draw the value again
+    SubTare tare;
+    uint32_t tare_us;   // time the tare command was acknowledged
+    uint8_t seq;        // sequence number of the last frame sent
+    LinkFrame_t cmd;    // command to send instead of a plain read
+    bool cmd_pending;   // cmd waits for its acknowledge
+    bool cmd_in_flight; // cmd went out with the last frame as cmd_seq
+    uint8_t cmd_seq;
+    uint16_t age_ms;    // age of the sample when it was read
+    uint link_errors;   // frames with bad header, length or CRC
+    SubLink link;
+    uint frames_ok;
+    uint frames_empty;  // nobody drove MISO
+    uint8_t link_fails; // empty or broken frames in a row
+    uint8_t good_run;   // good frames in a row since the last broken one
+    uint8_t backoff;    // poll rounds between two probes of an absent sub
+    uint8_t probe_wait; // poll rounds left until the next probe
+    uint baudrate;      // link clock found by the training
+    bool train_due;     // showed up without a training result, train it once
+    bool train_tried;
+    uint8_t pending;    // samples the sub still buffers for a burst
+    uint8_t burst_expect; // burst block to clock in with the next frame
+    uint32_t burst_ack_us; // sub time of the last burst sample taken
+    bool burst_acked;   // burst_ack_us is valid
+    bool burst_rewind;  // a block got lost, ask for all unacknowledged samples again
+    bool burst_resync;  // blocks before burst_resync_seq were built before the rewind
+    uint8_t burst_resync_seq;
+    bool latched;       // sub answers the sync line, show latched weights only
+    uint8_t latch_num;  // latch the last latched weight belongs to
+    int16_t latch_skew_us; // time of that weight relative to the latch
+    LinkStatus_t status; // last status frame of the sub
+    bool status_new;    // status not printed yet
 } SubModule;
 
 typedef enum Mode {
@@ -28,14 +90,19 @@ typedef enum SubName {
     kRR     = 3
 } SubName;
 
+struct Metrics_t;
+
 int pad_left_calc(float input);
-void print_normal_numbers(char disp_buf[]);
+void print_normal_numbers(char disp_buf[], uint first, uint rows);
 void print_cross_numbers(char disp_buf[]);
 void draw_mode_indicator_text(Mode mode_next);
 void clear_mode_indicator_text(Mode mode_next);
 void set_mode_indicator_bar(Mode mode_next);
-void print_KG(SubModule sub_modules[],char disp_buf[]);
-void print_percent(SubModule sub_modules[],char disp_buf[]);
-void print_cross(SubModule sub_modules[],char disp_buf[]);
+void draw_stable_indicator(uint8_t row, bool stable);
+void draw_record_indicator(bool recording);
+void unfreeze_all(SubModule sub_modules[]);
+void print_KG(SubModule sub_modules[], uint first, uint rows, char disp_buf[]);
+void print_percent(SubModule sub_modules[], const struct Metrics_t *metrics, uint first, uint rows, char disp_buf[]);
+void print_cross(SubModule sub_modules[], const struct Metrics_t *metrics, char disp_buf[]);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+// Author: Christoph Deussen
+
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "link_master.h"
+
+static spi_inst_t *master_spi;
+static LinkSelect_t select_sub;
+static uint tx_dma;
+static uint rx_dma;
+static uint gap_alarm;
+static uint baud_now = 0;
+
+static LinkXfer_t queue[LINK_MASTER_QUEUE_LEN];
+static volatile uint32_t queue_head = 0;    // written with interrupts off only
+static volatile uint32_t queue_tail = 0;    // written from the interrupts only
+static volatile bool running = false;       // a transfer or a gap is under way
+static LinkXfer_t *active = NULL;
+static uint64_t last_end_us = 0;
+
+static void link_master_next();
+
+static void link_master_set_baud(uint baudrate) {
+    if (baud_now != baudrate) {
+        spi_set_baudrate(master_spi, baudrate);
+        baud_now = baudrate;
+    }
+}
+
+// chip select low and both DMA channels started at once
+static void link_master_start(LinkXfer_t *xfer) {
+    active = xfer;
+    link_master_set_baud(xfer->baudrate);
+    dma_channel_set_write_addr(rx_dma, xfer->in, false);
+    dma_channel_set_trans_count(rx_dma, xfer->len, false);
+    dma_channel_set_read_addr(tx_dma, xfer->out, false);
+    dma_channel_set_trans_count(tx_dma, xfer->len, false);
+    select_sub(xfer->cs, true);
+    dma_start_channel_mask((1u << tx_dma) | (1u << rx_dma));
+}
+
+static void gap_alarm_callback(uint alarm_num) {
+    link_master_start(&queue[queue_tail & (LINK_MASTER_QUEUE_LEN - 1)]);
+}
+
+// Start the oldest queued transfer, after its gap if one is set.
+static void link_master_next() {
+    if (queue_tail == queue_head) {
+        running = false;
+        return;
+    }
+    running = true;
+    LinkXfer_t *xfer = &queue[queue_tail & (LINK_MASTER_QUEUE_LEN - 1)];
+    uint64_t start = last_end_us + xfer->gap_us;
+    if ((xfer->gap_us == 0) || (time_us_64() >= start) ||
+        hardware_alarm_set_target(gap_alarm, from_us_since_boot(start))) {
+        link_master_start(xfer);
+    }
+}
+
+// The last byte is in once the RX channel is done, so chip select can go
+// high right away.
+static void __not_in_flash_func(link_master_irq_handler)() {
+    dma_channel_acknowledge_irq0(rx_dma);
+    LinkXfer_t *xfer = active;
+    select_sub(xfer->cs, false);
+    last_end_us = time_us_64();
+    active = NULL;
+    queue_tail++;
+    if (xfer->done != NULL) {
+        xfer->done(xfer->arg);
+    }
+    link_master_next();
+}
+
+void link_master_init(spi_inst_t *spi, LinkSelect_t select) {
+    master_spi = spi;
+    select_sub = select;
+    baud_now = spi_get_baudrate(spi);
+
+    tx_dma = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(tx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, spi_get_dreq(spi, true));
+    dma_channel_configure(tx_dma, &c, &spi_get_hw(spi)->dr, NULL, 0, false);
+
+    rx_dma = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(rx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, spi_get_dreq(spi, false));
+    dma_channel_configure(rx_dma, &c, NULL, &spi_get_hw(spi)->dr, 0, false);
+
+    gap_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(gap_alarm, gap_alarm_callback);
+
+    dma_channel_set_irq0_enabled(rx_dma, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, link_master_irq_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+// Add a transfer, it starts right away if the bus is idle. The buffers
+// must stay valid until its done callback ran. Returns false if the queue
+// is full.
+bool link_master_queue(const LinkXfer_t *xfer) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    bool queued = (queue_head - queue_tail) < LINK_MASTER_QUEUE_LEN;
+    if (queued) {
+        queue[queue_head & (LINK_MASTER_QUEUE_LEN - 1)] = *xfer;
+        queue_head++;
+        if (!running) {
+            link_master_next();
+        }
+    }
+    restore_interrupts(interrupts);
+    return queued;
+}
+
+bool link_master_busy() {
+    return running;
+}
+
+// Blocking transfer for link training, waits until the queue ran empty
+// and keeps the CPU on the bus. The done callback is not called.
+void link_master_transfer(const LinkXfer_t *xfer) {
+    while (running) {
+        tight_loop_contents();
+    }
+    if (xfer->gap_us > 0) {
+        sleep_until(from_us_since_boot(last_end_us + xfer->gap_us));
+    }
+    link_master_set_baud(xfer->baudrate);
+    select_sub(xfer->cs, true);
+    spi_write_read_blocking(master_spi, xfer->out, xfer->in, xfer->len);
+    select_sub(xfer->cs, false);
+    last_end_us = time_us_64();
+}
@@ -0,0 +1,38 @@
+// Author: Christoph Deussen
+//
+// DMA driven SPI master for the link to the subs. Transfers are queued and
+// run back to back, each framed by its own chip select. The CPU only steps
+// in between two transfers, from the DMA interrupt or a timer alarm.
+
+#ifndef LINK_MASTER_H
+#define LINK_MASTER_H
+
+#include "pico/stdlib.h"
+#include "hardware/spi.h"
+
+#define LINK_MASTER_QUEUE_LEN   16      // power of two, one transfer per sub
+
+// Runs in interrupt context once the transfer is over, chip select is
+// already high again.
+typedef void (*LinkDone_t)(uint arg);
+
+// Drives the chip select line cs, also from interrupt context.
+typedef void (*LinkSelect_t)(uint cs, bool select);
+
+typedef struct LinkXfer_t {
+    uint cs;                // handed to the select function
+    uint baudrate;
+    const uint8_t *out;
+    uint8_t *in;
+    uint len;
+    uint gap_us;            // chip select stays high at least this long before
+    LinkDone_t done;
+    uint arg;
+} LinkXfer_t;
+
+void link_master_init(spi_inst_t *spi, LinkSelect_t select);
+bool link_master_queue(const LinkXfer_t *xfer);
+bool link_master_busy();
+void link_master_transfer(const LinkXfer_t *xfer);
+
+#endif
@@ -0,0 +1,31 @@
+// Author: Christoph Deussen
+
+#include <assert.h>
+#include <string.h>
+#include "load_curve.h"
+
+static_assert((CURVE_LEN & (CURVE_LEN - 1)) == 0, "CURVE_LEN must be a power of two");
+
+void curve_init(LoadCurve_t *curve) {
+    memset(curve, 0, sizeof(LoadCurve_t));
+}
+
+void curve_add(LoadCurve_t *curve, const CurvePoint_t *point) {
+    curve->point[curve->head & (CURVE_LEN - 1)] = *point;
+    curve->head++;
+}
+
+// number of points held, at most CURVE_LEN
+uint curve_count(const LoadCurve_t *curve) {
+    return (curve->head < CURVE_LEN) ? curve->head : CURVE_LEN;
+}
+
+// index 0 is the oldest point held
+bool curve_get(const LoadCurve_t *curve, uint index, CurvePoint_t *point) {
+    uint count = curve_count(curve);
+    if (index >= count) {
+        return false;
+    }
+    *point = curve->point[(curve->head - count + index) & (CURVE_LEN - 1)];
+    return true;
+}
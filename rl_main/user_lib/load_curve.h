@@ -0,0 +1,28 @@
+// Author: Christoph Deussen
+//
+// Load curve of one sub, filled from the sample bursts
+
+#ifndef LOAD_CURVE_H
+#define LOAD_CURVE_H
+
+#include "pico/stdlib.h"
+
+#define CURVE_LEN   256     // power of two, the oldest point gets overwritten
+
+typedef struct CurvePoint_t {
+    int32_t grams;
+    uint32_t time_us;       // sub time the sample was taken
+    uint8_t flags;          // LINK_FLAG_*
+} CurvePoint_t;
+
+typedef struct LoadCurve_t {
+    CurvePoint_t point[CURVE_LEN];
+    uint32_t head;          // total number of points added
+} LoadCurve_t;
+
+void curve_init(LoadCurve_t *curve);
+void curve_add(LoadCurve_t *curve, const CurvePoint_t *point);
+uint curve_count(const LoadCurve_t *curve);
+bool curve_get(const LoadCurve_t *curve, uint index, CurvePoint_t *point);
+
+#endif
@@ -0,0 +1,66 @@
+// Author: Christoph Deussen
+
+#include <string.h>
+#include "metrics.h"
+
+void metrics_init(Metrics_t *metrics) {
+    memset(metrics, 0, sizeof(Metrics_t));
+    metrics->count = NUM_CORNERS;
+}
+
+// part of total in METRICS_SCALE, the product needs 64 bit above 2 t
+static int16_t metrics_share(int32_t part, int32_t total) {
+    if (total == 0) {
+        return 0;
+    }
+    int64_t share = ((int64_t)part * METRICS_SCALE) / total;
+    if (share > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if (share < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)share;
+}
+
+// Count all subs up to the highest one that answers, at least the corners.
+// Absent subs weigh zero.
+void metrics_update(Metrics_t *metrics, const SubModule subs[]) {
+    uint count = NUM_CORNERS;
+    for (uint i = NUM_CORNERS; i < NUM_SUBS; i++) {
+        if (subs[i].link != kSubAbsent) {
+            count = i + 1;
+        }
+    }
+
+    int32_t total = 0;
+    bool oor = false;
+    bool corners_oor = false;
+    for (uint i = 0; i < count; i++) {
+        total += subs[i].grams;
+        oor = oor || subs[i].oor_flag;
+        if (i < NUM_CORNERS) {
+            corners_oor = oor;
+        }
+    }
+    int32_t corners = subs[kFL].grams + subs[kFR].grams + subs[kRL].grams + subs[kRR].grams;
+
+    metrics->count = count;
+    metrics->total_g = total;
+    metrics->corners_g = corners;
+    metrics->valid = (total != 0) && !oor;
+    metrics->corners_valid = (corners != 0) && !corners_oor;
+    for (uint i = 0; i < NUM_SUBS; i++) {
+        metrics->share[i] = (i < count) ? metrics_share(subs[i].grams, total) : 0;
+    }
+    metrics->front = metrics_share(subs[kFL].grams + subs[kFR].grams, corners);
+    metrics->rear = metrics_share(subs[kRL].grams + subs[kRR].grams, corners);
+    metrics->left = metrics_share(subs[kFL].grams + subs[kRL].grams, corners);
+    metrics->right = metrics_share(subs[kFR].grams + subs[kRR].grams, corners);
+    metrics->cross_flrr = metrics_share(subs[kFL].grams + subs[kRR].grams, corners);
+    metrics->cross_frrl = metrics_share(subs[kFR].grams + subs[kRL].grams, corners);
+    // the axle loads balance the weight around its center of gravity
+    metrics->cog_long = metrics->rear;
+    metrics->cog_lat = (metrics->right - metrics->left) / 2;
+    metrics->version++;
+}
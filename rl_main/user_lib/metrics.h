@@ -0,0 +1,37 @@
+// Author: Christoph Deussen
+//
+// Figures derived from the weights of all subs. They are computed once per
+// set of samples in fixed point and every view reads the cached copy, the
+// version tells whether anything changed since it last looked.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "pico/stdlib.h"
+#include "display_helpers.h"
+
+#define METRICS_SCALE   1000    // shares and positions in 0.1 %
+#define NUM_CORNERS     4       // subs 1 to 4 are FL, FR, RL and RR
+
+typedef struct Metrics_t {
+    uint32_t version;           // counts up with every update
+    uint8_t count;              // subs 1 to count are in the total
+    bool valid;                 // total not zero and no sub out of range
+    bool corners_valid;         // the same for the four corners
+    int32_t total_g;            // all counted subs
+    int32_t corners_g;          // the four corners
+    int16_t share[NUM_SUBS];    // of total_g
+    int16_t front;              // this and the following of corners_g
+    int16_t rear;
+    int16_t left;
+    int16_t right;
+    int16_t cross_flrr;         // front left + rear right
+    int16_t cross_frrl;         // front right + rear left
+    int16_t cog_long;           // behind the front axle, of the wheelbase
+    int16_t cog_lat;            // right of the center line, of the track width
+} Metrics_t;
+
+void metrics_init(Metrics_t *metrics);
+void metrics_update(Metrics_t *metrics, const SubModule subs[]);
+
+#endif
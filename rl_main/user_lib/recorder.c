@@ -0,0 +1,350 @@
+// Author: Christoph Deussen
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "link_protocol.h"
+#include "recorder.h"
+
+#define RECORD_HEADER_LEN   sizeof(RecordHeader_t)
+#define RECORD_DATA_LEN     (RECORD_BLOCK_SIZE - RECORD_HEADER_LEN)
+#define RECORD_MAX_LEN      11      // sub byte and two varints of up to 5 bytes
+#define RECORD_CRC_START    6       // the CRC covers everything after itself
+
+static_assert(RECORD_HEADER_LEN == 20, "RecordHeader_t must not be padded");
+static_assert((RECORD_FLASH_OFFSET % FLASH_SECTOR_SIZE) == 0, "RECORD_FLASH_OFFSET must be sector aligned");
+
+// One block takes the records while the other one waits for the flash.
+// Both are only touched with interrupts off, records come from the DMA
+// interrupt.
+static uint8_t blocks[2][RECORD_BLOCK_SIZE];
+static uint fill = 0;
+static volatile int ready = -1;         // block to program next, -1 if none
+static uint len;                        // bytes of records in the filling block
+static uint count;
+static uint32_t start_ms;
+static uint32_t last_ms;
+static int32_t last_grams[RECORD_MAX_SUBS];
+
+static volatile bool running = false;
+static bool closing = false;            // stopped, the last block has to go out
+static bool start_queued = false;       // started while closing, runs once the last block is out
+static uint16_t session = 0;            // current or last session
+static uint32_t next_seq = 0;
+static uint next_block = 0;             // sector the ready block goes to
+static bool next_erased = false;
+static RecordStats_t stats;
+
+// session being printed, a few records per recorder_task
+static struct {
+    bool active;
+    uint16_t session;
+    uint first;                         // oldest block of the session
+    uint32_t first_seq;
+    uint n;                             // block of the session printed now
+    bool checked;                       // CRC of that block is good
+    uint pos;                           // next record in the block
+    uint r;
+    uint32_t time_ms;
+    int32_t grams[RECORD_MAX_SUBS];
+} dump;
+
+static void dump_step();
+
+static const RecordHeader_t *flash_block(uint block) {
+    return (const RecordHeader_t *)(XIP_BASE + RECORD_FLASH_OFFSET + block * RECORD_BLOCK_SIZE);
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static uint put_varint(uint8_t *buf, uint32_t value) {
+    uint n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+// bytes used, 0 if the varint runs past avail
+static uint get_varint(const uint8_t *buf, uint avail, uint32_t *value) {
+    *value = 0;
+    for (uint n = 0; (n < avail) && (n < 5); n++) {
+        *value |= (uint32_t)(buf[n] & 0x7f) << (7 * n);
+        if (!(buf[n] & 0x80)) {
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static void block_open() {
+    len = 0;
+    count = 0;
+    memset(last_grams, 0, sizeof(last_grams));
+}
+
+// Put the header in front of the records and hand the block over to the
+// flash. Needs the other block to be programmed already.
+static void block_close() {
+    RecordHeader_t header = {
+        .magic = RECORD_MAGIC,
+        .session = session,
+        .seq = next_seq++,
+        .start_ms = start_ms,
+        .count = count,
+        .len = len
+    };
+    uint8_t *block = blocks[fill];
+    memcpy(block, &header, RECORD_HEADER_LEN);
+    memset(&block[RECORD_HEADER_LEN + len], 0xff, RECORD_DATA_LEN - len);
+    header.crc = link_crc16(&block[RECORD_CRC_START], RECORD_HEADER_LEN - RECORD_CRC_START + len);
+    memcpy(block, &header, RECORD_HEADER_LEN);
+    ready = fill;
+    fill ^= 1;
+    block_open();
+}
+
+// core1 runs from flash, it has to wait while the flash is written
+static uint32_t flash_begin(bool *lockout) {
+    *lockout = multicore_lockout_victim_is_initialized(1);
+    if (*lockout) {
+        multicore_lockout_start_blocking();
+    }
+    return save_and_disable_interrupts();
+}
+
+static void flash_end(bool lockout, uint32_t interrupts) {
+    restore_interrupts(interrupts);
+    if (lockout) {
+        multicore_lockout_end_blocking();
+    }
+}
+
+// Continue the log after the newest block in flash.
+void recorder_init() {
+    bool found = false;
+    uint32_t last_seq = 0;
+    for (uint i = 0; i < RECORD_NUM_BLOCKS; i++) {
+        const RecordHeader_t *header = flash_block(i);
+        if (header->magic != RECORD_MAGIC) {
+            continue;
+        }
+        if (!found || ((int32_t)(header->seq - last_seq) > 0)) {
+            found = true;
+            last_seq = header->seq;
+            session = header->session;
+            next_block = (i + 1) % RECORD_NUM_BLOCKS;
+        }
+    }
+    next_seq = found ? last_seq + 1 : 0;
+    fill = 0;
+    block_open();
+}
+
+// New session. While the last block of the one before is not written
+// yet, the start is queued for recorder_task and false returned.
+bool recorder_start() {
+    if (running) {
+        return true;
+    }
+    if (closing) {
+        start_queued = true;
+        return false;
+    }
+    session++;
+    running = true;
+    return true;
+}
+
+void recorder_stop() {
+    start_queued = false;
+    if (running) {
+        running = false;
+        closing = true;
+    }
+}
+
+bool recorder_running() {
+    return running;
+}
+
+// started while the last session still closes
+bool recorder_queued() {
+    return start_queued;
+}
+
+// Append one sample, called from the DMA interrupt. With both blocks full
+// the sample is lost.
+void recorder_add(uint sub_num, uint32_t time_ms, int32_t grams, uint8_t flags) {
+    if (!running || (sub_num >= RECORD_MAX_SUBS)) {
+        return;
+    }
+    uint32_t interrupts = save_and_disable_interrupts();
+    if ((len + RECORD_MAX_LEN > RECORD_DATA_LEN) && (ready < 0)) {
+        block_close();
+    }
+    if (len + RECORD_MAX_LEN > RECORD_DATA_LEN) {
+        stats.dropped++;
+    } else {
+        if (count == 0) {
+            start_ms = time_ms;
+            last_ms = time_ms;
+        }
+        uint8_t *record = &blocks[fill][RECORD_HEADER_LEN + len];
+        uint n = 0;
+        record[n++] = sub_num | ((flags & 0x0f) << 4);
+        n += put_varint(&record[n], zigzag((int32_t)(time_ms - last_ms)));
+        n += put_varint(&record[n], zigzag(grams - last_grams[sub_num]));
+        len += n;
+        count++;
+        last_ms = time_ms;
+        last_grams[sub_num] = grams;
+        stats.records++;
+        if ((len + RECORD_MAX_LEN > RECORD_DATA_LEN) && (ready < 0)) {
+            block_close();
+        }
+    }
+    restore_interrupts(interrupts);
+}
+
+// One flash operation per call: program the ready block or erase the
+// sector for the next one. Both stop core1 and the interrupts of this
+// core, so no transfer must be under way.
+void recorder_task() {
+    dump_step();
+    if (closing && (ready < 0)) {
+        uint32_t interrupts = save_and_disable_interrupts();
+        if (count > 0) {
+            block_close();
+        }
+        closing = false;
+        restore_interrupts(interrupts);
+        if (start_queued) {
+            start_queued = false;
+            recorder_start();
+        }
+    }
+    bool lockout;
+    uint32_t offset = RECORD_FLASH_OFFSET + next_block * RECORD_BLOCK_SIZE;
+    if ((ready >= 0) && next_erased) {
+        RecordHeader_t header;
+        memcpy(&header, blocks[ready], RECORD_HEADER_LEN);
+        // only the pages holding records, the rest stays erased
+        uint bytes = (RECORD_HEADER_LEN + header.len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+        uint32_t interrupts = flash_begin(&lockout);
+        flash_range_program(offset, blocks[ready], bytes);
+        flash_end(lockout, interrupts);
+        next_block = (next_block + 1) % RECORD_NUM_BLOCKS;
+        next_erased = false;
+        stats.blocks++;
+        ready = -1;
+    } else if (!next_erased && (running || (ready >= 0))) {
+        // the oldest block in the ring goes
+        uint32_t interrupts = flash_begin(&lockout);
+        flash_range_erase(offset, RECORD_BLOCK_SIZE);
+        flash_end(lockout, interrupts);
+        next_erased = true;
+    }
+}
+
+void recorder_print() {
+    printf("Recorder: %s, session %u, %lu blocks, %lu records, %lu dropped, next block %u of %u\n",
+           running ? "running" : start_queued ? "starting" : "stopped", session, (unsigned long)stats.blocks, (unsigned long)stats.records,
+           (unsigned long)stats.dropped, next_block, RECORD_NUM_BLOCKS);
+}
+
+// Print a session as CSV, the last one if session_num is negative. Only
+// the start is looked up here, recorder_task prints RECORD_DUMP_LINES
+// records per run, so polling and recording go on during a dump.
+void recorder_dump(int session_num) {
+    uint16_t wanted = (session_num < 0) ? session : (uint16_t)session_num;
+    int first = -1;
+    uint32_t first_seq = 0;
+    for (uint i = 0; i < RECORD_NUM_BLOCKS; i++) {
+        const RecordHeader_t *header = flash_block(i);
+        if ((header->magic == RECORD_MAGIC) && (header->session == wanted) &&
+            ((first < 0) || ((int32_t)(header->seq - first_seq) < 0))) {
+            first = i;
+            first_seq = header->seq;
+        }
+    }
+    if (first < 0) {
+        printf("No blocks of session %u\n", wanted);
+        return;
+    }
+
+    printf("time_ms,sub,kg,flags\n");
+    dump.active = true;
+    dump.session = wanted;
+    dump.first = first;
+    dump.first_seq = first_seq;
+    dump.n = 0;
+    dump.checked = false;
+}
+
+static void dump_next_block() {
+    dump.n++;
+    dump.checked = false;
+}
+
+// Blocks with a bad CRC are left out. The session ends with the first
+// block that does not follow, also if the ring overwrote it meanwhile.
+static void dump_step() {
+    uint lines = 0;
+    while (dump.active && (lines < RECORD_DUMP_LINES)) {
+        const RecordHeader_t *header = flash_block((dump.first + dump.n) % RECORD_NUM_BLOCKS);
+        if ((dump.n >= RECORD_NUM_BLOCKS) || (header->magic != RECORD_MAGIC) || (header->session != dump.session) ||
+            (header->seq != dump.first_seq + dump.n)) {
+            printf("# end of session %u\n", dump.session);
+            dump.active = false;
+            return;
+        }
+        const uint8_t *block = (const uint8_t *)header;
+        if (!dump.checked) {
+            if ((header->len > RECORD_DATA_LEN) ||
+                (link_crc16(&block[RECORD_CRC_START], RECORD_HEADER_LEN - RECORD_CRC_START + header->len) != header->crc)) {
+                printf("# block %lu broken\n", (unsigned long)header->seq);
+                lines++;
+                dump_next_block();
+                continue;
+            }
+            dump.checked = true;
+            dump.pos = 0;
+            dump.r = 0;
+            dump.time_ms = header->start_ms;
+            memset(dump.grams, 0, sizeof(dump.grams));
+        }
+        if ((dump.r >= header->count) || (dump.pos >= header->len)) {
+            dump_next_block();
+            continue;
+        }
+        const uint8_t *data = &block[RECORD_HEADER_LEN];
+        uint32_t value;
+        uint sub_num = data[dump.pos] & 0x0f;
+        uint flags = data[dump.pos] >> 4;
+        uint pos = dump.pos + 1;
+        uint used = get_varint(&data[pos], header->len - pos, &value);
+        pos += used;
+        dump.time_ms += unzigzag(value);
+        used = used ? get_varint(&data[pos], header->len - pos, &value) : 0;
+        if (used == 0) {
+            dump_next_block();
+            continue;
+        }
+        dump.pos = pos + used;
+        dump.r++;
+        dump.grams[sub_num] += unzigzag(value);
+        printf("%lu,%u,%.3f,%u\n", (unsigned long)dump.time_ms, sub_num + 1, dump.grams[sub_num] / 1000.0f, flags);
+        lines++;
+    }
+}
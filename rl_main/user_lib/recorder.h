@@ -0,0 +1,52 @@
+// Author: Christoph Deussen
+//
+// Session recorder. Samples of all subs are packed into blocks of one
+// flash sector, each one readable on its own, and written to a ring in the
+// upper half of the flash. A block is only programmed between two poll
+// rounds, one flash operation per call of recorder_task.
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#define RECORD_FLASH_OFFSET (1024 * 1024)
+#define RECORD_FLASH_SIZE   (1024 * 1024)
+#define RECORD_BLOCK_SIZE   FLASH_SECTOR_SIZE
+#define RECORD_NUM_BLOCKS   (RECORD_FLASH_SIZE / RECORD_BLOCK_SIZE)
+#define RECORD_MAGIC        0x31474f4c      // "LOG1"
+#define RECORD_MAX_SUBS     16
+#define RECORD_DUMP_LINES   16      // records printed per recorder_task
+
+// Start of every block. A record is one byte sub | flags << 4, then the
+// time since the record before and the weight change of that sub since
+// its record before, both as zigzag varints. The first record of a block
+// counts from start_ms and zero grams.
+typedef struct RecordHeader_t {
+    uint32_t magic;
+    uint16_t crc;           // CRC16 over the rest of the header and the records
+    uint16_t session;
+    uint32_t seq;           // counts up from block to block, also across sessions
+    uint32_t start_ms;      // head time
+    uint16_t count;         // records in the block
+    uint16_t len;           // bytes of records after the header
+} RecordHeader_t;
+
+typedef struct RecordStats_t {
+    uint32_t blocks;        // programmed since boot
+    uint32_t records;
+    uint32_t dropped;       // no free block, the flash fell behind
+} RecordStats_t;
+
+void recorder_init();
+bool recorder_start();
+void recorder_stop();
+bool recorder_running();
+bool recorder_queued();
+void recorder_add(uint sub_num, uint32_t time_ms, int32_t grams, uint8_t flags);
+void recorder_task();
+void recorder_print();
+void recorder_dump(int session);
+
+#endif
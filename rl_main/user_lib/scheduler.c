@@ -0,0 +1,106 @@
+// Author: Christoph Deussen
+
+#include <stdio.h>
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "scheduler.h"
+
+static Task_t *sched_tasks;
+static uint sched_num;
+static uint sched_alarm;
+static volatile bool alarm_fired = false;
+static uint64_t idle_us = 0;        // time spent asleep
+static uint64_t start_us = 0;
+
+// only there to wake the core
+static void sched_alarm_callback(uint alarm_num) {
+    alarm_fired = true;
+}
+
+// Tasks start at their phase in the first period after now. The table is
+// in priority order, of two tasks due at the same time the first runs first.
+void sched_init(Task_t *tasks, uint num) {
+    sched_tasks = tasks;
+    sched_num = num;
+    sched_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(sched_alarm, sched_alarm_callback);
+
+    start_us = time_us_64();
+    for (uint i = 0; i < num; i++) {
+        Task_t *task = &tasks[i];
+        task->next_us = (start_us / task->period_us + 1) * task->period_us + task->phase_us;
+        task->runs = 0;
+        task->late = 0;
+        task->skipped = 0;
+        task->max_late_us = 0;
+        task->max_run_us = 0;
+    }
+}
+
+// Run the first task that is due, or sleep until the next one is.
+void sched_run_once() {
+    uint64_t now = time_us_64();
+    uint64_t next = UINT64_MAX;
+    for (uint i = 0; i < sched_num; i++) {
+        Task_t *task = &sched_tasks[i];
+        if (task->next_us > now) {
+            if (task->next_us < next) {
+                next = task->next_us;
+            }
+            continue;
+        }
+        uint64_t late = now - task->next_us;
+        if (late > task->deadline_us) {
+            task->late++;
+        }
+        if (late > task->max_late_us) {
+            task->max_late_us = (late > UINT32_MAX) ? UINT32_MAX : (uint32_t)late;
+        }
+        // stay on the grid, slots that passed completely are dropped
+        task->next_us += task->period_us;
+        if (task->next_us <= now) {
+            uint64_t missed = (now - task->next_us) / task->period_us + 1;
+            task->skipped += missed;
+            task->next_us += missed * task->period_us;
+        }
+
+        task->run(task->arg);
+        uint32_t run_us = (uint32_t)(time_us_64() - now);
+        if (run_us > task->max_run_us) {
+            task->max_run_us = run_us;
+        }
+        task->runs++;
+        return;
+    }
+
+    // An interrupt that comes after interrupts are disabled still ends the
+    // wfi, so the alarm cannot slip in between the check and the sleep.
+    alarm_fired = false;
+    if (hardware_alarm_set_target(sched_alarm, from_us_since_boot(next))) {
+        return;     // already due
+    }
+    uint32_t interrupts = save_and_disable_interrupts();
+    if (!alarm_fired) {
+        uint64_t sleep_start = time_us_64();
+        __wfi();
+        idle_us += time_us_64() - sleep_start;
+    }
+    restore_interrupts(interrupts);
+}
+
+// time asleep since sched_init
+uint64_t sched_idle_us() {
+    return idle_us;
+}
+
+void sched_print() {
+    uint64_t total = time_us_64() - start_us;
+    printf("Idle %.1f %%\n", (total > 0) ? 100.0f * idle_us / total : 0.0f);
+    printf("task        period   runs     late  skipped  max late  max run\n");
+    for (uint i = 0; i < sched_num; i++) {
+        Task_t *task = &sched_tasks[i];
+        printf("%-10s %6lu us %7lu %7lu %7lu %7lu us %6lu us\n", task->name, (unsigned long)task->period_us,
+               (unsigned long)task->runs, (unsigned long)task->late, (unsigned long)task->skipped,
+               (unsigned long)task->max_late_us, (unsigned long)task->max_run_us);
+    }
+}
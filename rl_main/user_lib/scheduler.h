@@ -0,0 +1,36 @@
+// Author: Christoph Deussen
+//
+// Periodic task table for the main loop of the head. Every task starts at
+// a fixed phase within its period on the 64 bit microsecond timer, so the
+// slots stay the same from run to run and never wrap. Between tasks the
+// core sleeps until a hardware alarm or another interrupt wakes it.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "pico/stdlib.h"
+
+typedef void (*TaskFunc_t)(uint arg);
+
+typedef struct Task_t {
+    const char *name;
+    TaskFunc_t run;
+    uint arg;
+    uint32_t period_us;
+    uint32_t phase_us;          // start within the period
+    uint32_t deadline_us;       // latest start after the slot before it counts as late
+    // filled in by the scheduler
+    uint64_t next_us;
+    uint32_t runs;
+    uint32_t late;              // started after the deadline
+    uint32_t skipped;           // slots missed entirely
+    uint32_t max_late_us;       // worst start delay
+    uint32_t max_run_us;        // worst run time
+} Task_t;
+
+void sched_init(Task_t *tasks, uint num);
+void sched_run_once();
+uint64_t sched_idle_us();
+void sched_print();
+
+#endif
@@ -0,0 +1,148 @@
+// Author: Christoph Deussen
+
+#include <assert.h>
+#include <stdio.h>
+#include "pico/stdio_usb.h"
+#include "hardware/sync.h"
+#include "tusb.h"
+#include "link_protocol.h"
+#include "stream.h"
+
+static_assert((STREAM_RING_LEN & (STREAM_RING_LEN - 1)) == 0, "STREAM_RING_LEN must be a power of two");
+static_assert(STREAM_RING_LEN >= 2 * STREAM_ROUND_LEN, "STREAM_RING_LEN too short for two rounds of bursts");
+
+static uint8_t ring[STREAM_RING_LEN];
+static volatile uint32_t ring_head = 0;     // written with interrupts off only
+static volatile uint32_t ring_tail = 0;     // written by stream_task only
+static volatile bool running = false;
+static uint16_t seq = 0;
+static StreamStats_t stats;
+static uint32_t dropped_reported = 0;
+static uint32_t report_ms = 0;
+
+static uint put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return 2;
+}
+
+static uint put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v & 0xffff);
+    put_u16(&p[2], v >> 16);
+    return 4;
+}
+
+// Queue one frame, whole or not at all. Safe from interrupts.
+static void stream_put(StreamType type, uint32_t time_ms, const uint8_t *payload, uint len) {
+    uint8_t frame[STREAM_HEADER_LEN + STREAM_MAX_PAYLOAD + 2];
+    if (!running) {
+        return;
+    }
+    uint32_t interrupts = save_and_disable_interrupts();
+    uint total = STREAM_HEADER_LEN + len + 2;
+    if (total > STREAM_RING_LEN - (ring_head - ring_tail)) {
+        stats.dropped++;
+        seq++;
+        restore_interrupts(interrupts);
+        return;
+    }
+    frame[0] = STREAM_SYNC0;
+    frame[1] = STREAM_SYNC1;
+    frame[2] = type;
+    frame[3] = len;
+    put_u16(&frame[4], seq++);
+    put_u32(&frame[6], time_ms);
+    for (uint i = 0; i < len; i++) {
+        frame[STREAM_HEADER_LEN + i] = payload[i];
+    }
+    put_u16(&frame[STREAM_HEADER_LEN + len], link_crc16(&frame[2], STREAM_HEADER_LEN - 2 + len));
+    for (uint i = 0; i < total; i++) {
+        ring[(ring_head + i) & (STREAM_RING_LEN - 1)] = frame[i];
+    }
+    ring_head += total;
+    restore_interrupts(interrupts);
+}
+
+void stream_start() {
+    running = true;
+}
+
+// frames already queued still go out
+void stream_stop() {
+    running = false;
+}
+
+bool stream_running() {
+    return running;
+}
+
+void stream_sample(uint sub_num, uint32_t time_ms, int32_t grams, uint8_t flags) {
+    uint8_t payload[STREAM_SAMPLE_LEN - STREAM_HEADER_LEN - 2];
+    payload[0] = sub_num;
+    payload[1] = flags;
+    put_u32(&payload[2], grams);
+    stream_put(kStreamSample, time_ms, payload, sizeof(payload));
+}
+
+void stream_set(uint32_t time_ms, const SubModule subs[], const Metrics_t *metrics) {
+    uint8_t payload[STREAM_SET_LEN - STREAM_HEADER_LEN - 2];
+    static_assert(sizeof(payload) <= STREAM_MAX_PAYLOAD, "set frame too long");
+    uint n = 0;
+    payload[n++] = metrics->count;
+    payload[n++] = (metrics->valid ? 0x01 : 0) | (metrics->corners_valid ? 0x02 : 0);
+    for (uint i = 0; i < metrics->count; i++) {
+        n += put_u32(&payload[n], subs[i].grams);
+        payload[n++] = (subs[i].stable ? STREAM_SUB_STABLE : 0) | (subs[i].oor_flag ? STREAM_SUB_OOR : 0) |
+                       ((subs[i].link << 2) & STREAM_SUB_LINK);
+    }
+    n += put_u32(&payload[n], metrics->total_g);
+    n += put_u32(&payload[n], metrics->corners_g);
+    n += put_u16(&payload[n], metrics->front);
+    n += put_u16(&payload[n], metrics->rear);
+    n += put_u16(&payload[n], metrics->left);
+    n += put_u16(&payload[n], metrics->right);
+    n += put_u16(&payload[n], metrics->cross_flrr);
+    n += put_u16(&payload[n], metrics->cross_frrl);
+    n += put_u16(&payload[n], metrics->cog_long);
+    n += put_u16(&payload[n], metrics->cog_lat);
+    stream_put(kStreamSet, time_ms, payload, n);
+}
+
+// Hand the ring to USB as far as the CDC buffer has room, never waits.
+// Without a host the queued frames are thrown away.
+void stream_task() {
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    if ((stats.dropped != dropped_reported) && ((now_ms - report_ms) >= STREAM_REPORT_MS)) {
+        printf("Stream: %lu frames dropped, ring full\n", (unsigned long)(stats.dropped - dropped_reported));
+        dropped_reported = stats.dropped;
+        report_ms = now_ms;
+    }
+    if (!stdio_usb_connected()) {
+        ring_tail = ring_head;
+        return;
+    }
+    uint32_t head = ring_head;
+    while (head != ring_tail) {
+        uint room = tud_cdc_write_available();
+        if (room == 0) {
+            return;
+        }
+        // up to the end of the ring, the rest in the next round
+        uint tail = ring_tail & (STREAM_RING_LEN - 1);
+        uint len = head - ring_tail;
+        if (len > STREAM_RING_LEN - tail) {
+            len = STREAM_RING_LEN - tail;
+        }
+        if (len > room) {
+            len = room;
+        }
+        stdio_usb.out_chars((const char *)&ring[tail], len);
+        ring_tail += len;
+        stats.bytes += len;
+    }
+}
+
+void stream_print() {
+    printf("Stream: %s, %lu bytes sent, %u queued, %lu frames dropped\n", running ? "running" : "stopped",
+           (unsigned long)stats.bytes, (uint)(ring_head - ring_tail), (unsigned long)stats.dropped);
+}
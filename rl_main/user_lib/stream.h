@@ -0,0 +1,68 @@
+// Author: Christoph Deussen
+//
+// Binary stream of the weights to a PC over the USB serial port. Frames
+// are queued in a ring from any context and sent by stream_task as far as
+// the USB buffer takes them, a host that stops reading only costs frames.
+//
+// Frame, little endian:
+//  0   0xa5 0x5a
+//  2   type (StreamType)
+//  3   payload length
+//  4   sequence number, counts every frame queued or dropped
+//  6   head time in ms
+//  10  payload
+//  ..  CRC16 over type up to the end of the payload
+// Text from the console can show up between two frames, the host syncs
+// on the start bytes and the CRC. Frames dropped for a full ring leave a
+// gap in the sequence numbers and are reported on the console.
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "pico/stdlib.h"
+#include "metrics.h"
+#include "link_protocol.h"
+
+#define STREAM_SYNC0        0xa5
+#define STREAM_SYNC1        0x5a
+#define STREAM_HEADER_LEN   10
+#define STREAM_MAX_PAYLOAD  0xff
+#define STREAM_SAMPLE_LEN   (STREAM_HEADER_LEN + 6 + 2)
+#define STREAM_SET_LEN      (STREAM_HEADER_LEN + 2 + NUM_SUBS * 5 + 24 + 2)
+// full bursts of all subs and the set frame of one poll round
+#define STREAM_ROUND_LEN    (NUM_SUBS * LINK_BURST_MAX * STREAM_SAMPLE_LEN + STREAM_SET_LEN)
+// power of two, holds two rounds while USB catches up
+#if NUM_SUBS > 4
+#define STREAM_RING_LEN     32768
+#else
+#define STREAM_RING_LEN     16384
+#endif
+#define STREAM_REPORT_MS    1000    // shortest time between two reports of dropped frames
+
+// sub flags in a set frame
+#define STREAM_SUB_STABLE   0x01
+#define STREAM_SUB_OOR      0x02
+#define STREAM_SUB_LINK     0x0c    // SubLink << 2
+
+typedef enum StreamType {
+    kStreamSample   = 1,    // sub u8, flags u8 (LINK_FLAG_*), grams i32: every sample of a sub
+    kStreamSet      = 2     // all subs and the metrics, once per poll round: count u8,
+                            // valid u8, per sub grams i32 and flags u8, total and corner
+                            // grams i32, front, rear, left, right, both crosses and the
+                            // CoG i16 as in Metrics_t
+} StreamType;
+
+typedef struct StreamStats_t {
+    uint32_t bytes;         // handed to USB
+    uint32_t dropped;       // ring full
+} StreamStats_t;
+
+void stream_start();
+void stream_stop();
+bool stream_running();
+void stream_sample(uint sub_num, uint32_t time_ms, int32_t grams, uint8_t flags);
+void stream_set(uint32_t time_ms, const SubModule subs[], const Metrics_t *metrics);
+void stream_task();
+void stream_print();
+
+#endif
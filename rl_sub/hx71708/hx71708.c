@@ -1,20 +1,107 @@
+#include <assert.h>
+
 #include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 #include "pico/time.h"
 #include "hx71708.h"
+#include "hx71708.pio.h"
+
+static_assert(hx71708_HX1_DOUT == HX1_DOUT && hx71708_HX2_DOUT == HX2_DOUT, "DOUT pins in hx71708.pio out of sync");
+
+static int pio_offset = -1;
+static HX71708_t *sm_inst[4];
+
+static const uint rate_sps[] = { 10, 20, 80, 320 };
+
+// Raised whenever a state machine pushed a conversion. Stamps it with the
+// time DOUT went low and moves it into the channel queue so no sample
+// waits for the main loop. A single word was pushed right now, its DOUT
+// edge lies exactly HX71708_READOUT_US back. After the interrupt was held
+// off, several words wait and each older one is stamped one nominal
+// conversion period further back. Those stamps are estimates, off by the
+// oscillator tolerance and by up to a period for the newest word.
+//
+// The handler also runs while core0 erases flash, so it only touches RAM
+// and reads the timer registers itself. A gap of more than one and a half
+// periods to the conversion before means the PIO stalled on a full FIFO
+// and missed the conversions in between, they are counted.
+static inline uint64_t __not_in_flash_func(timer_now_us)() {
+    uint32_t hi = timer_hw->timerawh;
+    uint32_t lo;
+    while (true) {
+        lo = timer_hw->timerawl;
+        uint32_t next = timer_hw->timerawh;
+        if (next == hi) break;
+        hi = next;
+    }
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void __not_in_flash_func(HX71708_irq_handler)() {
+    uint64_t now = timer_now_us();
+    for (uint sm = 0; sm < 4; sm++) {
+        HX71708_t *inst = sm_inst[sm];
+        if (inst == NULL) continue;
+        uint period_us = inst->period_us;
+        uint backlog = pio_sm_get_rx_fifo_level(HX_PIO, sm);
+        while (backlog > 0) {
+            backlog--;
+            uint32_t word = pio_sm_get(HX_PIO, sm);
+            uint head = inst->queue_head;
+            if (((head + 1) & (HX_QUEUE_LEN - 1)) == inst->queue_tail) {
+                inst->queue_overflows++;
+                continue;
+            }
+            int hx_data = word & 0xffffff;
+            if (hx_data > 0x7fffff) {
+                hx_data -= 0x1000000;
+            }
+            uint64_t stamp = now - HX71708_READOUT_US - (uint64_t)backlog * period_us;
+            if (inst->last_stamp != 0) {
+                while (stamp > inst->last_stamp + period_us + period_us / 2) {
+                    inst->lost_conversions++;
+                    inst->last_stamp += period_us;
+                }
+            }
+            inst->last_stamp = stamp;
+            inst->queue[head].raw = hx_data;
+            inst->queue[head].timestamp = stamp;
+            inst->queue_head = (head + 1) & (HX_QUEUE_LEN - 1);
+        }
+    }
+}
 
-inline void delay_asm(int clocks) {
-    for (int i = 0; i < clocks; i++) {
-        __asm__("NOP");
+static void HX71708_claim(HX71708_t *inst, uint entry) {
+    if (pio_offset < 0) {
+        pio_offset = pio_add_program(HX_PIO, &hx71708_program);
+        irq_set_exclusive_handler(HX_PIO_IRQ, HX71708_irq_handler);
+        irq_set_enabled(HX_PIO_IRQ, true);
+    }
+    inst->sm = pio_claim_unused_sm(HX_PIO, true);
+    inst->queue_head = 0;
+    inst->queue_tail = 0;
+    if (inst->history_max == 0) {
+        HX71708_set_smoothing(inst, HIST_DEFAULT, HIST_DEFAULT, 0);
     }
+    sm_inst[inst->sm] = inst;
+    hx71708_program_init(HX_PIO, inst->sm, pio_offset, entry, inst->dout, inst->sck);
+    // picked up after the first conversion, which always runs at 10 SPS
+    HX71708_set_rate(inst, inst->rate);
+    pio_set_irq0_source_enabled(HX_PIO, pis_sm0_rx_fifo_not_empty + inst->sm, true);
 }
 
+// Power down and up again, SCK has to stay high for more than 60 us.
+// The chips keep DOUT high until their first conversion has settled and
+// the PIO waits for that, so there is no need to sleep here.
 void HX71708_reset() {
     gpio_put(HX1_SCK, 1);
     gpio_put(HX2_SCK, 1);
-    sleep_us(200);
+    sleep_us(100);
     gpio_put(HX1_SCK, 0);
     gpio_put(HX2_SCK, 0);
-    sleep_ms(400);
 }
 
 void HX71708_init() {
@@ -30,48 +117,161 @@ void HX71708_init() {
     HX71708_reset();
 }
 
-int HX71708_read(HX71708_t *inst) {
-    int hx_data = 0;
-    int j = 23;
-    for (int i = 0; i < 25; i++) {
-        gpio_put(inst->sck, 1);
-        delay_asm(3);
-        gpio_put(inst->sck, 0);
-        if (j >= 0)
-            hx_data |= (gpio_get(inst->dout) << j);
-        else
-            delay_asm(2);
-
-        j--;
-        delay_asm(1);
-    }
-    if (hx_data > 0x7fffff) {
-        hx_data -= 0x1000000;
+// Hand SCK over to a PIO state machine, which clocks out every finished
+// conversion on its own. Call after HX71708_init().
+void HX71708_start(HX71708_t *inst) {
+    HX71708_claim(inst, hx71708_offset_single);
+    pio_sm_set_enabled(HX_PIO, inst->sm, true);
+}
+
+// Start both channels of a pad in lockstep. The state machines are enabled
+// on the same clock cycle and wait until both chips are ready, so HX1_SCK
+// and HX2_SCK are driven with identical edges and both words are available
+// after a single 25 bit readout. Both samples get the same timestamp.
+void HX71708_start_pair(HX71708_t *inst_a, HX71708_t *inst_b) {
+    HX71708_claim(inst_a, hx71708_offset_lockstep);
+    HX71708_claim(inst_b, hx71708_offset_lockstep);
+    pio_enable_sm_mask_in_sync(HX_PIO, (1u << inst_a->sm) | (1u << inst_b->sm));
+}
+
+// Select the output data rate. Takes effect with the readout of the next
+// conversion, so the conversion after that comes at the new rate.
+// Channels started with HX71708_start_pair() have to use the same rate.
+void HX71708_set_rate(HX71708_t *inst, HX71708_Rate rate) {
+    if (rate > kHxRate320) rate = kHxRate10;
+    inst->rate = rate;
+    // divided here, the division helper of the interrupt could sit in
+    // flash. The gap to the next conversion still follows the old rate.
+    uint32_t interrupts = save_and_disable_interrupts();
+    inst->period_us = 1000000 / rate_sps[rate];
+    inst->last_stamp = 0;
+    restore_interrupts(interrupts);
+    if (!pio_sm_is_tx_fifo_full(HX_PIO, inst->sm)) {
+        pio_sm_put(HX_PIO, inst->sm, (uint32_t)rate);
     }
-    if ((inst->offset_counter < OFFSET_NUM)) {
-        inst->offset += hx_data;
-        inst->offset_counter++;
-        return 0;
-    } else if (inst->offset_counter == OFFSET_NUM) {
-        inst->offset = inst->offset / OFFSET_NUM;
-        inst->offset_counter++;
+}
+
+uint HX71708_rate_sps(HX71708_Rate rate) {
+    return rate_sps[rate];
+}
+
+bool HX71708_rate_from_sps(uint sps, HX71708_Rate *rate) {
+    for (uint i = 0; i < count_of(rate_sps); i++) {
+        if (rate_sps[i] == sps) {
+            *rate = (HX71708_Rate)i;
+            return true;
+        }
     }
+    return false;
+}
+
+// Adaptive averaging over the history ring. A raw value further than
+// step_threshold from the current mean shortens the window to min_len so a
+// load change is followed within a few samples. While the signal stays flat
+// the window grows by one sample per conversion up to max_len.
+// With step_threshold = 0 the window is fixed at max_len.
+void HX71708_set_smoothing(HX71708_t *inst, uint min_len, uint max_len, int step_threshold) {
+    if (max_len > HIST_NUM) max_len = HIST_NUM;
+    if (max_len < 1) max_len = 1;
+    if ((min_len < 1) || (min_len > max_len)) min_len = max_len;
+    inst->history_min = min_len;
+    inst->history_max = max_len;
+    inst->step_threshold = step_threshold;
+    // restart the window with the newest value
+    inst->history_len = 0;
+}
 
+// Zero offset subtracted from the averaged value. Applied with the next
+// conversion, the averaging history stays untouched.
+void HX71708_set_offset(HX71708_t *inst, int offset) {
+    inst->offset = offset;
+}
+
+// true if at least one conversion is waiting in the channel queue
+bool HX71708_is_ready(const HX71708_t *inst) {
+    return inst->queue_head != inst->queue_tail;
+}
+
+static const HX71708_Sample_t *HX71708_peek(const HX71708_t *inst) {
+    return &inst->queue[inst->queue_tail];
+}
+
+static void HX71708_pop(HX71708_t *inst) {
+    inst->queue_tail = (inst->queue_tail + 1) & (HX_QUEUE_LEN - 1);
+}
+
+// apply offset and averaging of one channel to a new raw conversion
+static int HX71708_update(HX71708_t *inst, const HX71708_Sample_t *sample) {
+    int hx_data = sample->raw;
+
+    inst->sample_stats.sample_now = sample->timestamp;
+    inst->sample_stats.sample_time = (uint)(inst->sample_stats.sample_now - inst->sample_stats.sample_last);
+    inst->sample_stats.sample_last = inst->sample_stats.sample_now;
+
+    inst->raw = hx_data;
+
+    // running sum over the last history_len values of the ring
+    uint len = inst->history_len;
+    if (len == 0) {
+        len = 1;
+        inst->history_sum = hx_data;
+    } else {
+        int mean = inst->history_sum / (int)len;
+        int deviation = hx_data - mean;
+        if ((inst->step_threshold > 0) && ((deviation > inst->step_threshold) || (deviation < -inst->step_threshold))) {
+            // step: restart with the newest min_len values
+            len = inst->history_min;
+            inst->history_sum = hx_data;
+            for (uint i = 1; i < len; i++) {
+                inst->history_sum += inst->history[(inst->history_index + HIST_NUM - i) % HIST_NUM];
+            }
+        } else if (len < inst->history_max) {
+            // flat: lengthen the window by one
+            len++;
+            inst->history_sum += hx_data;
+        } else {
+            // the oldest value of the window drops out
+            inst->history_sum += hx_data - inst->history[(inst->history_index + HIST_NUM - len) % HIST_NUM];
+        }
+    }
+    inst->history_len = len;
     inst->history[inst->history_index] = hx_data;
     inst->history_index++;
     if (inst->history_index > (HIST_NUM - 1)) inst->history_index = 0;
 
-    int sum = 0;
-    for (int i = 0; i < HIST_NUM; i++) {
-        sum += inst->history[i];
-    }
-    sum = sum / HIST_NUM;
+    int sum = inst->history_sum / (int)len;
 
     inst->output = sum - inst->offset;
 
-    inst->sample_stats.sample_now = time_us_64() / 1000;
-    inst->sample_stats.sample_time = (inst->sample_stats.sample_now - inst->sample_stats.sample_last);
-    inst->sample_stats.sample_last = inst->sample_stats.sample_now;
-
     return inst->output;
-}
\ No newline at end of file
+}
+
+// Take the oldest queued conversion. Only call if HX71708_is_ready().
+int HX71708_read(HX71708_t *inst) {
+    int output = HX71708_update(inst, HX71708_peek(inst));
+    HX71708_pop(inst);
+    return output;
+}
+
+// Align the queues of both channels of a pad by timestamp. Samples without
+// a partner within half a conversion period still go through offset and
+// history of their channel, so nothing is dropped if one chip lags the
+// other. Returns true and both outputs once an aligned pair was found.
+bool HX71708_read_pair(HX71708_t *inst_a, HX71708_t *inst_b, int *out_a, int *out_b) {
+    HX71708_Rate fastest = (inst_a->rate > inst_b->rate) ? inst_a->rate : inst_b->rate;
+    int64_t window = 500000 / rate_sps[fastest];
+
+    while (HX71708_is_ready(inst_a) && HX71708_is_ready(inst_b)) {
+        int64_t diff = (int64_t)(HX71708_peek(inst_a)->timestamp - HX71708_peek(inst_b)->timestamp);
+        if (diff < -window) {
+            HX71708_read(inst_a);
+        } else if (diff > window) {
+            HX71708_read(inst_b);
+        } else {
+            *out_a = HX71708_read(inst_a);
+            *out_b = HX71708_read(inst_b);
+            return true;
+        }
+    }
+    return false;
+}
@@ -5,32 +5,74 @@
 #ifndef HX71708_H
 #define HX71708_H
 
-#define OFFSET_NUM  3
-#define HIST_NUM    3
+#include "hardware/pio.h"
+
+#define HIST_NUM    32      // size of the history ring, longest averaging window
+#define HIST_DEFAULT 3      // averaging window if no smoothing was set up
 #define HX1_DOUT    0
 #define HX1_SCK     1
 #define HX2_DOUT    2
 #define HX2_SCK     3
+#define HX_PIO      pio0
+#define HX_PIO_IRQ  PIO0_IRQ_0
+
+#define HX_QUEUE_LEN        128     // power of two, 400 ms at 320 SPS covers a sector erase
+
+// output data rate, selected by the number of SCK pulses per readout
+typedef enum HX71708_Rate {
+    kHxRate10   = 0,    // 25 pulses
+    kHxRate20   = 1,    // 26 pulses
+    kHxRate80   = 2,    // 27 pulses
+    kHxRate320  = 3     // 28 pulses
+} HX71708_Rate;
 
 typedef struct {
-    uint sample_now;
-    uint sample_last;
+    uint64_t sample_now;
+    uint64_t sample_last;
     uint sample_time;
 } SampleStats_t;
 
+typedef struct {
+    int raw;
+    uint64_t timestamp;
+} HX71708_Sample_t;
+
 typedef struct {
     uint dout;
     uint sck;
+    uint sm;
+    HX71708_Rate rate;
     int output;
+    int raw;                // latest conversion before offset and averaging
     int offset;
-    int offset_counter;
     int history[HIST_NUM];
     int history_index;
+    int history_sum;        // sum of the last history_len values
+    uint history_len;       // current averaging window
+    uint history_min;       // window right after a step
+    uint history_max;       // window once the signal is flat
+    int step_threshold;     // deviation from the mean counted as step, 0 = fixed window
     SampleStats_t sample_stats;
+    HX71708_Sample_t queue[HX_QUEUE_LEN];
+    volatile uint queue_head;
+    volatile uint queue_tail;
+    uint queue_overflows;
+    uint period_us;         // nominal conversion period at the current rate
+    uint64_t last_stamp;    // newest conversion, 0 after a rate change
+    uint lost_conversions;  // missed while the PIO waited for room in the RX FIFO
 } HX71708_t;
 
 void HX71708_reset();
 void HX71708_init();
+void HX71708_start(HX71708_t *inst);
+void HX71708_start_pair(HX71708_t *inst_a, HX71708_t *inst_b);
+void HX71708_set_rate(HX71708_t *inst, HX71708_Rate rate);
+uint HX71708_rate_sps(HX71708_Rate rate);
+bool HX71708_rate_from_sps(uint sps, HX71708_Rate *rate);
+void HX71708_set_smoothing(HX71708_t *inst, uint min_len, uint max_len, int step_threshold);
+void HX71708_set_offset(HX71708_t *inst, int offset);
+bool HX71708_is_ready(const HX71708_t *inst);
 int HX71708_read(HX71708_t *inst);
+bool HX71708_read_pair(HX71708_t *inst_a, HX71708_t *inst_b, int *out_a, int *out_b);
 
-#endif
\ No newline at end of file
+#endif
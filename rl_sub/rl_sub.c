@@ -8,215 +8,668 @@
 #define CLEAR_BIT(x, pos)	(x &= (~(1U << pos)))
 #define TOGGLE_BIT(x, pos)	(x ^= (1U << pos))
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 
 #include "pico/stdlib.h"
 #include "pico/binary_info.h"
-#include "hardware/spi.h"
+#include "pico/multicore.h"
 #include "hardware/flash.h" // for the flash erasing and writing
 #include "hardware/sync.h" // for the interrupts
 
 #include "hx71708.h"
+#include "sample_ring.h"
+#include "filter.h"
+#include "stability.h"
+#include "tare.h"
+#include "calibration.h"
+#include "spi_slave.h"
+#include "zero_log.h"
+#include "flash_park.h"
+#include "link_protocol.h"
 
 #define FLASH_TARGET_OFFSET (512 * 1024) // choosing to start at 512K
+#define SETTINGS_MAGIC      0x37534c52      // "RLS7"
 
-#define BUF_LEN         4
+#define LEGACY_COUNTS_PER_KG    26700   // scale of the single factor calibration
+#define CALIB_CAPTURE_NUM       32      // samples averaged for a calibration point
 
 #define LED_PIN         25
-#define SPI_COM_PORT    spi0
-#define SPI_COM_RX      16
+#define SPI_COM_RX      16      // MOSI, chip select and SCK must follow it for the PIO
 #define SPI_COM_TX      19
 #define SPI_COM_SCK     18
 #define SPI_COM_CS      17
+#define SYNC_IN         20      // latch line, driven by the head for all subs
 
-HX71708_t hx1 = { .dout = HX1_DOUT, .sck = HX1_SCK, .offset = 0, .offset_counter = 0 };
-HX71708_t hx2 = { .dout = HX2_DOUT, .sck = HX2_SCK, .offset = 0, .offset_counter = 0 };
+// 1: clock both HX71708 with the same SCK edges, 0: read each chip as soon
+// as it is ready and align the samples by timestamp
+#define HX_LOCKSTEP     0
 
-volatile int timerval1 = 0;
-volatile int timerval2 = 0;
+// 1: core1 owns both HX71708 and hands finished samples to core0 through
+// sample_ring, so console output and flash writes never delay a readout.
+// 0: acquisition is polled from the main loop on core0.
+#define ACQ_ON_CORE1    1
+
+HX71708_t hx1 = { .dout = HX1_DOUT, .sck = HX1_SCK, .offset = 0 };
+HX71708_t hx2 = { .dout = HX2_DOUT, .sck = HX2_SCK, .offset = 0 };
 
 uint32_t time_now   = 0;
 uint32_t time_last  = 0;
-int32_t hx1_data    = 0;
-int32_t hx2_data    = 0;
-
-uint8_t out_buf[4], in_buf[5];
-
-typedef enum Console_Mode { debug_out, calib_in } CONSOLE_MODE_t;
+int hx1_data        = 0;
+int hx2_data        = 0;
+int32_t total_grams = 0;
+
+uint8_t out_buf[LINK_FRAME_LEN], in_buf[LINK_FRAME_LEN];
+
+static_assert((SPI_COM_CS == SPI_COM_RX + 1) && (SPI_COM_SCK == SPI_COM_RX + 2), "PIO SPI slave needs MOSI, CS, SCK in a row");
+
+// samples go out with their flags unchanged
+static_assert((SAMPLE_FLAG_STABLE == LINK_FLAG_STABLE) && (SAMPLE_FLAG_TARE_BUSY == LINK_FLAG_TARE_BUSY) &&
+              (SAMPLE_FLAG_TARE_DONE == LINK_FLAG_TARE_DONE) && (SAMPLE_FLAG_GAP == LINK_FLAG_GAP),
+              "sample flags differ from the link flags");
+
+// every published sample waits here until the head acknowledges it after a burst
+SampleRing_t burst_ring;
+bool burst_gap = false;
+volatile uint32_t burst_sent = 0;   // oldest samples in burst_ring sent but not acknowledged
+
+volatile uint8_t link_seq = 0;      // sequence number of the last valid command
+uint32_t link_errors = 0;           // frames from the head with a bad header or CRC
+volatile uint32_t link_frames = 0;  // published frames loaded for the head
+bool status_pending = false;        // status frame waits to be sent, hold back samples
+uint32_t status_hold = 0;           // link_frames when the status frame was set
+bool sample_pending = false;
+LoadSample_t latest_sample;
+
+// weight at the last edge on the sync line, interpolated between the
+// samples before and after it
+volatile uint64_t latch_us = 0;
+volatile uint8_t latch_num = 0;
+volatile uint8_t latch_next = 1;    // number the head gives its next latch
+volatile bool latch_wait = false;   // edge seen, sample after it not yet
+bool latch_due = false;             // latched frame ready, waits for the status frame to go out
+LinkFrame_t latch_frame;
+uint64_t latch_stamp = 0;
+bool latch_pending = false;         // latched frame waits to be sent
+uint32_t latch_hold = 0;
+LoadSample_t prev_sample;
+
+SampleRing_t sample_ring;
+volatile bool tare_request = false;
+
+typedef enum Console_Mode { debug_out, calib_in, filter_in } CONSOLE_MODE_t;
 CONSOLE_MODE_t console_mode = debug_out;
 
-char calib_val[4] = { 'x', 'x', 'x', 'x' };
-uint8_t calib_counter = 0;
-volatile int calib_int = 0;
+// Everything stored in flash. calib_val stays first so the factor written
+// by older firmware can be turned into a calibration table.
+typedef struct {
+    char calib_val[4];
+    uint32_t magic;
+    FilterStageCfg_t filter[2][FILTER_MAX_STAGES];
+    uint16_t stab_window;
+    uint16_t stab_hold;
+    int32_t stab_threshold;
+    uint8_t smooth_min;
+    uint8_t smooth_max;
+    int32_t smooth_step;
+    uint8_t rate[2];            // HX71708_Rate per channel
+    uint8_t tare_num;           // conversions averaged for a tare
+    uint8_t zero_valid;         // zero_offset holds the result of a tare
+    int32_t zero_offset[2];     // last tare, used from the first conversion after boot
+    CalibTable_t calib[2];      // counts to grams per channel
+} Settings_t;
+
+// Filter set up matching an output data rate. The faster rates are
+// decimated on the sub, so the head sees 40 or 80 well averaged samples
+// per second instead of 10.
+typedef struct {
+    const char *filter;
+    uint8_t smooth_min;
+    uint8_t smooth_max;
+} RatePreset_t;
+
+const RatePreset_t rate_presets[] = {
+    [kHxRate10]  = { .filter = "-",        .smooth_min = 1, .smooth_max = 4 },
+    [kHxRate20]  = { .filter = "m3",       .smooth_min = 1, .smooth_max = 8 },
+    [kHxRate80]  = { .filter = "m3 a4 d2", .smooth_min = 2, .smooth_max = 16 },
+    [kHxRate320] = { .filter = "m5 a8 d4", .smooth_min = 2, .smooth_max = 32 },
+};
+
+Settings_t settings = { .calib_val = { 'x', 'x', 'x', 'x' } };
+
+Calib_t calib_hx1;
+Calib_t calib_hx2;
+
+// guided calibration on the console
+CalibTable_t calib_edit;
+uint8_t calib_channel = 0;      // 1 or 2, 0 = not chosen yet
+int32_t calib_grams = 0;        // weight of the point being captured
+uint calib_capture = 0;         // samples still to average, 0 = idle
+int64_t calib_capture_sum = 0;
+
+FilterChain_t filter_hx1;
+FilterChain_t filter_hx2;
+int32_t hx1_filtered = 0;
+int32_t hx2_filtered = 0;
+volatile bool filter_update = true;
+Stability_t stability;
+Tare_t tare_hx1;
+Tare_t tare_hx2;
+LoadSample_t held_sample;       // sent while a tare is running
+volatile bool zero_changed = false;
+
+// boot phase timings in us since reset, shown on the console
+#define NUM_BOOT_PHASES     3
+typedef enum BootPhase {
+    kBootSettings       = 0,    // settings read from flash
+    kBootAcquisition    = 1,    // HX71708 running
+    kBootFirstSample    = 2     // first zeroed sample ready for the head
+} BootPhase;
+const char *const boot_phase_names[NUM_BOOT_PHASES] = { "settings", "acquisition", "first sample" };
+uint32_t boot_time_us[NUM_BOOT_PHASES];
+
+char console_line[24];
+uint8_t console_line_len = 0;
 
 void save_calib_data();
 void read_calib_data();
-
-// Callback for SPI communication. When chip select goes high,
-// disconnect push-pull stage from and set SPI_COM_TX to high
-// impedance to not hinder other subordinate units from communicating.
-// When chip select goes low, connect push-pull and SPI function to pin.
+void print_filters();
+void print_calibration(const CalibTable_t *table);
+void apply_rate_preset(int channel, HX71708_Rate rate);
+void set_rate(int channel, HX71708_Rate rate);
+void link_command(const LinkFrame_t *cmd);
+void send_status();
+void send_sample(const LoadSample_t *sample);
+void send_latched(const LoadSample_t *before, const LoadSample_t *after);
+uint link_burst(const LinkFrame_t *cmd, uint8_t *tx);
+uint8_t burst_pending();
+
+// A rising edge on the sync line only notes the time of the latch.
 void gpio_callback(uint gpio, uint32_t events) {
-    int cr1 = spi_get_hw(SPI_COM_PORT)->cr1;
-    if (!gpio_get(gpio)) {
-        gpio_set_function(SPI_COM_TX, GPIO_FUNC_SPI);
-        timerval1 = time_us_64();
+    if (gpio == SYNC_IN) {
+        latch_us = time_us_64();
+        // counts on by itself if no read came in since the last latch
+        latch_num = latch_next++;
+        latch_wait = true;
+    }
+}
+
+void acquisition_init() {
+    hx1.rate = settings.rate[0];
+    hx2.rate = settings.rate[1];
+    HX71708_init();
+    if (settings.zero_valid) {
+        // zero of the last tare is valid from the first conversion on
+        HX71708_set_offset(&hx1, settings.zero_offset[0]);
+        HX71708_set_offset(&hx2, settings.zero_offset[1]);
     } else {
-        gpio_set_function(SPI_COM_TX, GPIO_FUNC_SIO);
-        timerval2 = time_us_64();
+        // never tared, zero both channels with the first conversions
+        tare_start(&tare_hx1, settings.tare_num);
+        tare_start(&tare_hx2, settings.tare_num);
+    }
+#if HX_LOCKSTEP
+    HX71708_start_pair(&hx1, &hx2);
+#else
+    HX71708_start(&hx1);
+    HX71708_start(&hx2);
+#endif
+    boot_time_us[kBootAcquisition] = time_us_32();
+}
+
+// Process every aligned HX71708 pair, run it through the filter chain of
+// each channel and publish the result to core0.
+// Samples are queued by the HX71708 interrupt as soon as they are clocked out.
+void acquisition_poll() {
+    LoadSample_t sample;
+    int hx1_out, hx2_out;
+
+    if (filter_update) {
+        filter_update = false;
+        filter_chain_configure(&filter_hx1, settings.filter[0]);
+        filter_chain_configure(&filter_hx2, settings.filter[1]);
+        stability_init(&stability, settings.stab_window, settings.stab_threshold, settings.stab_hold);
+        HX71708_set_smoothing(&hx1, settings.smooth_min, settings.smooth_max, settings.smooth_step);
+        HX71708_set_smoothing(&hx2, settings.smooth_min, settings.smooth_max, settings.smooth_step);
+        calib_build(&calib_hx1, &settings.calib[0]);
+        calib_build(&calib_hx2, &settings.calib[1]);
+        if (hx1.rate != settings.rate[0]) {
+            HX71708_set_rate(&hx1, settings.rate[0]);
+        }
+        if (hx2.rate != settings.rate[1]) {
+            HX71708_set_rate(&hx2, settings.rate[1]);
+        }
+    }
+    if (tare_request) {
+        tare_request = false;
+        // a repeated request while collecting does not start over
+        if (tare_hx1.state != kTareBusy) {
+            tare_start(&tare_hx1, settings.tare_num);
+            tare_start(&tare_hx2, settings.tare_num);
+        }
+    }
+    if (HX71708_read_pair(&hx1, &hx2, &hx1_out, &hx2_out)) {
+        if (tare_hx1.state == kTareBusy) {
+            bool done_hx1 = tare_add(&tare_hx1, hx1.raw);
+            bool done_hx2 = tare_add(&tare_hx2, hx2.raw);
+            if (done_hx1 && done_hx2) {
+                // Swap both offsets between two conversions. Only this core
+                // reads them, so the next sample already uses the new zero.
+                HX71708_set_offset(&hx1, tare_result(&tare_hx1));
+                HX71708_set_offset(&hx2, tare_result(&tare_hx2));
+                // filters and stability still hold values of the old zero
+                filter_update = true;
+                // core0 takes the new zero into the settings
+                zero_changed = true;
+                return;
+            }
+        }
+        // a decimating chain only produces every n-th sample
+        bool new_hx1 = filter_chain_process(&filter_hx1, hx1_out, &hx1_filtered);
+        bool new_hx2 = filter_chain_process(&filter_hx2, hx2_out, &hx2_filtered);
+        if (!new_hx1 && !new_hx2) {
+            return;
+        }
+        sample.hx1 = hx1_filtered;
+        sample.hx2 = hx2_filtered;
+
+        // calibrate each chip on its own and add up the grams
+        sample.value = calib_apply(&calib_hx1, sample.hx1) + calib_apply(&calib_hx2, sample.hx2);
+        sample.timestamp = (hx1.sample_stats.sample_now + hx2.sample_stats.sample_now) / 2;
+        sample.flags = 0;
+        if (tare_hx1.state == kTareBusy) {
+            // keep the stream alive with the last value before the tare
+            sample.value = held_sample.value;
+            sample.hx1 = held_sample.hx1;
+            sample.hx2 = held_sample.hx2;
+            sample.flags |= SAMPLE_FLAG_TARE_BUSY;
+        } else {
+            if (stability_update(&stability, sample.value)) {
+                sample.flags |= SAMPLE_FLAG_STABLE;
+            }
+            if (tare_hx1.state == kTareDone) {
+                sample.flags |= SAMPLE_FLAG_TARE_DONE;
+            }
+            held_sample = sample;
+        }
+        sample_ring_push(&sample_ring, &sample);
+    }
+}
+
+void core1_entry() {
+    // allow core0 to park this core while it writes to flash
+    flash_park_enable();
+    acquisition_init();
+    while (1) {
+        flash_park_poll();
+        acquisition_poll();
     }
 }
 
-// inline function to check if spi transmit buffer is empty
-static inline bool spi_tx_is_empty(const spi_inst_t *spi) {
-    return (spi_get_const_hw(spi)->sr & 0x01);
+// Runs in the end of transaction interrupt right before the next frame is loaded.
+// Acknowledges the command just received and puts the current age of the
+// sample into the frame. A link test pattern is echoed and a burst put
+// together right away, so both are ready for the next transaction.
+uint link_hook(const uint8_t *rx, uint8_t *tx, uint64_t stamp) {
+    LinkFrame_t cmd;
+    if ((rx != NULL) && (link_decode(rx, &cmd) == kLinkOk)) {
+        link_seq = cmd.seq;
+        uint8_t latch;
+        if (link_get_latch(&cmd, &latch)) {
+            latch_next = latch;
+        }
+        if (cmd.cmd == kLinkCmdEcho) {
+            cmd.cmd = kLinkRspEcho;
+            link_encode(&cmd, tx);
+            return LINK_FRAME_LEN;
+        }
+        if (cmd.cmd == kLinkCmdBurst) {
+            return link_burst(&cmd, tx);
+        }
+    }
+    // nothing published yet
+    if (tx[0] != LINK_HEADER) {
+        return LINK_FRAME_LEN;
+    }
+    link_frames++;
+    uint64_t age_ms = (time_us_64() - stamp) / 1000;
+    link_patch(tx, link_seq, (age_ms > 0xffff) ? 0xffff : (uint16_t)age_ms);
+    return LINK_FRAME_LEN;
+}
+
+// Put up to the requested number of buffered samples behind a burst
+// header. The head clocks exactly the requested length, slots without a
+// sample stay zero. Samples stay in the ring until a later command
+// acknowledges them, after a rewind the unacknowledged ones go out again.
+uint link_burst(const LinkFrame_t *cmd, uint8_t *tx) {
+    LinkBurstCmd_t req;
+    link_get_burst_cmd(cmd, &req);
+    uint requested = (req.count > LINK_BURST_MAX) ? LINK_BURST_MAX : req.count;
+    uint8_t *block = &tx[LINK_FRAME_LEN];
+    uint block_len = requested * LINK_BURST_SAMPLE_LEN;
+    LinkBurst_t burst = { 0 };
+    LoadSample_t sample;
+
+    if (cmd->len < 6) {
+        // a head that only sends the count takes everything sent before as arrived
+        sample_ring_drop(&burst_ring, burst_sent);
+        burst_sent = 0;
+    } else if (req.flags & LINK_BURST_ACK) {
+        while ((burst_sent > 0) && sample_ring_peek(&burst_ring, 0, &sample) &&
+               ((int32_t)((uint32_t)sample.timestamp - req.ack_us) <= 0)) {
+            sample_ring_drop(&burst_ring, 1);
+            burst_sent--;
+        }
+    }
+    // nothing is dropped here, the unacknowledged samples go out again
+    if (req.flags & LINK_BURST_REWIND) {
+        burst_sent = 0;
+    }
+
+    memset(block, 0, block_len);
+    while ((burst.count < requested) && sample_ring_peek(&burst_ring, burst_sent, &sample)) {
+        LinkBurstSample_t burst_sample = {
+            .grams = sample.value,
+            .flags = sample.flags,
+            .time_us = (uint32_t)sample.timestamp
+        };
+        link_put_burst_sample(block, burst.count++, &burst_sample);
+        burst_sent++;
+    }
+    burst.pending = burst_pending();
+    burst.block_crc = link_crc16(block, block_len);
+    burst.now_us = time_us_32();
+
+    LinkFrame_t frame = { .seq = cmd->seq };
+    link_put_burst(&frame, &burst);
+    link_encode(&frame, tx);
+    return LINK_FRAME_LEN + block_len;
+}
+
+// samples in burst_ring not sent yet
+uint8_t burst_pending() {
+    uint32_t pending = sample_ring_count(&burst_ring) - burst_sent;
+    return (pending > 0xff) ? 0xff : (uint8_t)pending;
 }
 
 int main() {
     // Enable UART so we can print
     stdio_init_all();
 
-    // Enable SPI 0 at 1 MHz and connect to GPIOs
-    spi_init(SPI_COM_PORT, 100 * 1000);
-    spi_set_format(SPI_COM_PORT, 8, SPI_CPOL_1, SPI_CPHA_1, SPI_MSB_FIRST);
-    spi_set_slave(SPI_COM_PORT, true);
-    gpio_set_function(SPI_COM_RX, GPIO_FUNC_SPI);
-    gpio_set_function(SPI_COM_SCK, GPIO_FUNC_SPI);
-    gpio_set_function(SPI_COM_TX, GPIO_FUNC_SIO);
-    gpio_set_function(SPI_COM_CS, GPIO_FUNC_SPI);
+    // SPI slave on PIO, it drives SPI_COM_TX only while chip select is low.
+    // The clock comes from the head, link training there finds the fastest.
+    spi_slave_init(SPI_COM_RX, SPI_COM_TX, link_hook);
 
     // Init GPIO pin for status LED
     gpio_init(LED_PIN);
     gpio_set_dir(LED_PIN, GPIO_OUT);
     gpio_put(LED_PIN, 0);
 
-    HX71708_init();
-
-    // Enable IRQ and set callback for SPI chip select pin to fix SPI communication
-    gpio_set_irq_enabled_with_callback(SPI_COM_CS, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &gpio_callback);
+    // sync line from the head, low while no head is connected
+    gpio_init(SYNC_IN);
+    gpio_pull_down(SYNC_IN);
+    gpio_set_irq_enabled_with_callback(SYNC_IN, GPIO_IRQ_EDGE_RISE, true, &gpio_callback);
 
-    // Write null terminator to in buffer for easier parsing
-    in_buf[4] = '\0';
-    
-    // Read calibration data from flash.
-    // If flash portion is not initialized, set calibration value to 1.000
+    // Read calibration data from flash
     read_calib_data();
-    if(calib_val[0] == 255){
-        calib_val[0] = '1';
-        calib_val[1] = '0';
-        calib_val[2] = '0';
-        calib_val[3] = '0';
-        save_calib_data();
-    }
-    // calculate integer calibration value from string stored in flash
-    for (int i = 0; i < 4; i++) {
-        calib_int += (calib_val[i] - 48) * pow(10, (3 - i));
+    // the last tare is newer than the zero in the settings
+    int32_t zero[2];
+    if (zero_log_init(zero)) {
+        settings.zero_offset[0] = zero[0];
+        settings.zero_offset[1] = zero[1];
+        settings.zero_valid = 1;
     }
+    boot_time_us[kBootSettings] = time_us_32();
+
+    // start acquisition only after the calibration is known
+    sample_ring_init(&sample_ring);
+    sample_ring_init(&burst_ring);
+#if ACQ_ON_CORE1
+    multicore_launch_core1(core1_entry);
+#else
+    acquisition_init();
+#endif
 
     printf("Start!\n");
 
     while (1) {
         time_now = time_us_64() / 1000;
-        if (!spi_is_busy(SPI_COM_PORT)) {
-            // check if SPI transmit buffer is empty
-            // if so, write latest values to transmit buffer
-            if (spi_tx_is_empty(SPI_COM_PORT)) {
-                spi_get_hw(SPI_COM_PORT)->dr = out_buf[0];
-                spi_get_hw(SPI_COM_PORT)->dr = out_buf[1];
-                spi_get_hw(SPI_COM_PORT)->dr = out_buf[2];
-                spi_get_hw(SPI_COM_PORT)->dr = out_buf[3];
+        // frame from the head, taken over by DMA during the last transaction
+        if (spi_slave_get_frame(in_buf)) {
+            LinkFrame_t cmd;
+            if (link_decode(in_buf, &cmd) == kLinkOk) {
+                link_command(&cmd);
+            } else {
+                link_errors++;
             }
-            // check if new data is in SPI reveive buffer
-            // if so, write data from buffer to array
-            if (spi_is_readable(SPI_COM_PORT)) {
-                in_buf[0] = spi_get_hw(SPI_COM_PORT)->dr;
-                in_buf[1] = spi_get_hw(SPI_COM_PORT)->dr;
-                in_buf[2] = spi_get_hw(SPI_COM_PORT)->dr;
-                in_buf[3] = spi_get_hw(SPI_COM_PORT)->dr;
+        }
+
+#if !ACQ_ON_CORE1
+        acquisition_poll();
+#endif
+        // take over every sample published by the acquisition
+        LoadSample_t sample;
+        while (sample_ring_pop(&sample_ring, &sample)) {
+            if ((boot_time_us[kBootFirstSample] == 0) && !(sample.flags & SAMPLE_FLAG_TARE_BUSY)) {
+                boot_time_us[kBootFirstSample] = time_us_32();
             }
-            // parse string from reveive buffer
-            if (strcmp(in_buf, "TARE") == 0) {
-                hx1.offset_counter = 0;
-                hx1.offset = 0;
-                hx2.offset_counter = 0;
-                hx2.offset = 0;
+            hx1_data = sample.hx1;
+            hx2_data = sample.hx2;
+            total_grams = sample.value;
+            gpio_xor_mask(1 << LED_PIN);
+
+            if (calib_capture > 0) {
+                calib_capture_sum += (calib_channel == 1) ? sample.hx1 : sample.hx2;
+                if (--calib_capture == 0) {
+                    calib_table_add(&calib_edit, (int32_t)(calib_capture_sum / CALIB_CAPTURE_NUM), calib_grams);
+                }
+            }
+
+            // mark the first sample after the head fell behind
+            if (burst_gap) {
+                sample.flags |= SAMPLE_FLAG_GAP;
             }
+            burst_gap = !sample_ring_push(&burst_ring, &sample);
+
+            // first sample after a latch, the latch lies between this one and the last
+            if (latch_wait && (sample.timestamp >= latch_us)) {
+                latch_wait = false;
+                send_latched(&prev_sample, &sample);
+            }
+            prev_sample = sample;
+
+            latest_sample = sample;
+            sample_pending = true;
+        }
+        // a requested status or latched frame goes out once before samples continue
+        if (status_pending && (link_frames != status_hold)) {
+            status_pending = false;
+        }
+        if (latch_pending && (link_frames != latch_hold)) {
+            latch_pending = false;
+        }
+        if (latch_due && !status_pending) {
+            latch_due = false;
+            link_encode(&latch_frame, out_buf);
+            spi_slave_set_frame(out_buf, latch_stamp);
+            latch_pending = true;
+            latch_hold = link_frames;
+        }
+        if (sample_pending && !status_pending && !latch_due && !latch_pending) {
+            sample_pending = false;
+            send_sample(&latest_sample);
+        }
+
+        // Erasing the settings sector stalls the link and overruns the HX
+        // FIFOs, every new zero goes to the zero log instead.
+        if (zero_changed) {
+            zero_changed = false;
+            settings.zero_offset[0] = hx1.offset;
+            settings.zero_offset[1] = hx2.offset;
+            settings.zero_valid = 1;
+            zero_log_write(settings.zero_offset);
         }
 
         // general scheduler
         if (time_now != time_last) {
-            // check if both HX71708 chips are ready to provide new data
-            if (!gpio_get(HX1_DOUT) && !gpio_get(HX2_DOUT)) {
-                hx1_data = HX71708_read(&hx1);
-                hx2_data = HX71708_read(&hx2);
-                gpio_xor_mask(1 << LED_PIN);
-
-                // add up data from both chips and apply calibration data
-                int32_t result = ~(((hx1_data + hx2_data) * calib_int) / 1000);
-
-                // write conversion result to output buffer
-                out_buf[0] = (uint8_t)((result >> 24) & 0xFF);
-                out_buf[1] = (uint8_t)((result >> 16) & 0xFF);
-                out_buf[2] = (uint8_t)((result >> 8) & 0xFF);
-                out_buf[3] = (uint8_t)(result & 0xFF);
-            }
             if ((time_now % 100) == 0) {
                 // check if new input is in serial terminal input buffer
                 char c = getchar_timeout_us(100);
                 switch (console_mode) {
                 case debug_out:
                     printf("%c%c%c%c", 0x1B, 0x5B, 0x32, 0x4A);
-                    printf("Press \"k\" to enter Calibration Mode.\n");
-                    printf("HX1: %.1f\t%d\t%d\n", (hx1_data / 26.7), hx1.offset, hx1.sample_stats.sample_time);
-                    printf("HX2: %.1f\t%d\t%d\n", (hx2_data / 26.7), hx2.offset, hx2.sample_stats.sample_time);
-                    printf("Total: %.1f\n", ((hx1_data + hx2_data) / 26.7));
-                    printf("Timerdiff: %d\n", timerval2 - timerval1);
-                    printf("Calibration Factor: %c.%c%c%c\n", calib_val[0], calib_val[1], calib_val[2], calib_val[3]);
+                    printf("Press \"k\" to enter Calibration Mode, \"f\" to set up filters.\n");
+                    printf("HX1: %d\t%d\t%dus\n", hx1_data, hx1.offset, hx1.sample_stats.sample_time);
+                    printf("HX2: %d\t%d\t%dus\n", hx2_data, hx2.offset, hx2.sample_stats.sample_time);
+                    printf("Lost conversions: HX1 %u, HX2 %u\n", hx1.lost_conversions, hx2.lost_conversions);
+                    printf("Boot:");
+                    for (int i = 0; i < NUM_BOOT_PHASES; i++) {
+                        printf(" %s %.1f ms", boot_phase_names[i], boot_time_us[i] / 1000.0f);
+                    }
+                    printf("\n");
+                    printf("Tare: %s\n", (tare_hx1.state == kTareBusy) ? "in progress" :
+                                         (tare_hx1.state == kTareDone) ? "done" : "none");
+                    printf("Total: %d g\n", (int)total_grams);
+                    printf("Link: %u frames, %u cut short, %u invalid, %u probes, seq %u\n",
+                           (uint)spi_slave_stats()->transactions, (uint)spi_slave_stats()->errors, (uint)link_errors,
+                           (uint)spi_slave_stats()->probes, link_seq);
+                    printf("Latch: %u\n", latch_num);
+                    printf("Calibration HX1:");
+                    print_calibration(&settings.calib[0]);
+                    printf("Calibration HX2:");
+                    print_calibration(&settings.calib[1]);
+                    print_filters();
                     printf("In Buffer: ");
                     printf(in_buf);
                     // check if "k" key was pressed, change to calibration input mode
                     if (c == 'k') {
-                        calib_counter = 0;
-                        for (int i=0; i < 4; i++) {
-                            calib_val[i] = 'x';
-                        }
+                        calib_channel = 0;
+                        calib_capture = 0;
+                        console_line_len = 0;
+                        console_line[0] = '\0';
                         console_mode = calib_in;
                     }
+                    // check if "f" key was pressed, change to filter input mode
+                    if (c == 'f') {
+                        console_line_len = 0;
+                        console_line[0] = '\0';
+                        console_mode = filter_in;
+                    }
                     break;
 
                 case calib_in:
                     printf("%c%c%c%c", 0x1B, 0x5B, 0x32, 0x4A);
                     printf("Calibration Mode:\n");
-                    printf("Enter calibration factor as integer in the format x.xx.\n");
-                    printf("Examples 1.051 or 0.964.\n");
-                    printf("Store value by pressing enter.\n");
-                    printf("New Calibration Factor: %c.%c%c%c\n", calib_val[0], calib_val[1], calib_val[2], calib_val[3]);
-                    if (calib_counter < 4) {
-                        if ((c >= '0') && (c <= '9')) {
-                            calib_val[calib_counter] = c;
-                            calib_counter++;
+                    if (calib_channel == 0) {
+                        printf("Select the channel to calibrate, \"1\" or \"2\". ESC leaves.\n");
+                        if ((c == '1') || (c == '2')) {
+                            // start over, tared and unloaded is 0 g
+                            calib_channel = c - '0';
+                            calib_table_clear(&calib_edit);
+                            calib_table_add(&calib_edit, 0, 0);
+                        }
+                    } else {
+                        printf("Channel HX%d. Tare without load first, 0 g is already in the table.\n", calib_channel);
+                        printf("Put a known weight on, type its mass in g and press enter.\n");
+                        printf("Up to %d points. Enter on an empty line stores the table, ESC discards it.\n", CALIB_MAX_POINTS);
+                        printf("Now: %d\n", (calib_channel == 1) ? hx1_data : hx2_data);
+                        printf("Points:");
+                        print_calibration(&calib_edit);
+                        if (calib_capture > 0) {
+                            printf("Capturing %d g, %d samples to go\n", (int)calib_grams, calib_capture);
+                        } else {
+                            printf("> %s\n", console_line);
+                            // check if "backspace" was pressed, delete latest character
+                            if ((c == 8) && (console_line_len > 0)) {
+                                console_line[--console_line_len] = '\0';
+                            } else if ((c >= '0') && (c <= '9') && (console_line_len < sizeof(console_line) - 1)) {
+                                console_line[console_line_len++] = c;
+                                console_line[console_line_len] = '\0';
+                            }
+                        }
+                        // check if "enter" was pressed, capture a point or store the table
+                        if ((c == 13) && (calib_capture == 0)) {
+                            if (console_line_len > 0) {
+                                int grams = 0;
+                                sscanf(console_line, "%d", &grams);
+                                calib_grams = grams;
+                                calib_capture_sum = 0;
+                                calib_capture = CALIB_CAPTURE_NUM;
+                                console_line_len = 0;
+                                console_line[0] = '\0';
+                            } else {
+                                Calib_t check;
+                                if (calib_build(&check, &calib_edit)) {
+                                    settings.calib[calib_channel - 1] = calib_edit;
+                                    save_calib_data();
+                                    filter_update = true;
+                                }
+                                console_mode = debug_out;
+                            }
                         }
                     }
-                    // check if "backspace" was pressed, delete latest value from input string
-                    if ((c == 8) && (calib_counter > 0)) {
-                        calib_val[calib_counter - 1] = (char)'x';
-                        calib_counter--;
+                    // check if "escape" was pressed, leave without storing
+                    if (c == 27) {
+                        calib_capture = 0;
+                        console_mode = debug_out;
                     }
-                    // check if "enter" was pressed, save data to flash and return to 
+                    break;
+
+                case filter_in:
+                    printf("%c%c%c%c", 0x1B, 0x5B, 0x32, 0x4A);
+                    printf("Filter Mode:\n");
+                    printf("Enter channel and up to %d stages, e.g. \"1 m5 a16 d4\".\n", FILTER_MAX_STAGES);
+                    printf("a<n>: moving average over n samples (max. %d)\n", FILTER_MAX_WINDOW);
+                    printf("i<k>: low pass, new sample weighted 1/2^k\n");
+                    printf("m<n>: median of n samples (odd, max. %d)\n", FILTER_MAX_MEDIAN);
+                    printf("d<n>: mean of n samples, one output per n inputs\n");
+                    printf("\"1 -\" removes all filters. Store by pressing enter.\n");
+                    printf("Stability detection: \"s <window> <threshold> <hold>\"\n");
+                    printf("Adaptive smoothing: \"w <min> <max> <step>\", step 0 = fixed window\n");
+                    printf("Data rate with matching filters: \"r <channel> <10|20|80|320>\", channel 0 = both\n");
+                    printf("Tare: \"t <samples>\" (4..%d), the highest and lowest quarter is dropped\n", TARE_MAX_SAMPLES);
+                    print_filters();
+                    printf("> %s\n", console_line);
+                    // check if "backspace" was pressed, delete latest character
+                    if ((c == 8) && (console_line_len > 0)) {
+                        console_line[--console_line_len] = '\0';
+                    } else if ((c >= ' ') && (c <= '~') && (console_line_len < sizeof(console_line) - 1)) {
+                        console_line[console_line_len++] = c;
+                        console_line[console_line_len] = '\0';
+                    }
+                    // check if "enter" was pressed, apply and save a valid setting
                     if (c == 13) {
-                        // check if user input a full number
-                        // save new data or load old data
-                        if (calib_counter == 4){
+                        int channel = console_line[0] - '1';
+                        int window, threshold, hold;
+                        int min_len, max_len, step;
+                        int rate_channel, sps;
+                        int tare_num;
+                        HX71708_Rate rate;
+                        if ((channel >= 0) && (channel <= 1) && (console_line_len > 1) &&
+                            filter_chain_parse(&console_line[1], settings.filter[channel])) {
+                            save_calib_data();
+                            filter_update = true;
+                        } else if ((sscanf(console_line, "s %d %d %d", &window, &threshold, &hold) == 3) &&
+                                   (window >= 2) && (window <= STAB_MAX_WINDOW) && (threshold > 0) && (hold >= 0)) {
+                            settings.stab_window = window;
+                            settings.stab_threshold = threshold;
+                            settings.stab_hold = hold;
+                            save_calib_data();
+                            filter_update = true;
+                        } else if ((sscanf(console_line, "w %d %d %d", &min_len, &max_len, &step) == 3) &&
+                                   (min_len >= 1) && (max_len >= min_len) && (max_len <= HIST_NUM) && (step >= 0)) {
+                            settings.smooth_min = min_len;
+                            settings.smooth_max = max_len;
+                            settings.smooth_step = step;
+                            save_calib_data();
+                            filter_update = true;
+                        } else if ((sscanf(console_line, "r %d %d", &rate_channel, &sps) == 2) &&
+                                   (rate_channel >= 0) && (rate_channel <= 2) && HX71708_rate_from_sps(sps, &rate)) {
+                            set_rate(rate_channel, rate);
+                        } else if ((sscanf(console_line, "t %d", &tare_num) == 1) &&
+                                   (tare_num >= 4) && (tare_num <= TARE_MAX_SAMPLES)) {
+                            settings.tare_num = tare_num;
                             save_calib_data();
-                            calib_int = 0;
-                            for (int i = 0; i < 4; i++) {
-                                calib_int += (calib_val[i] - 48) * pow(10, (3 - i));
-                            }
-                        }
-                        else{
-                            read_calib_data();
                         }
                         console_mode = debug_out;
                     }
@@ -235,23 +688,182 @@ int main() {
 // function to wirt and read to and from flash
 // taken and modified from https://forums.raspberrypi.com//viewtopic.php?f=144&t=310821
 void save_calib_data() {
-    uint8_t *myDataAsBytes = (uint8_t *)&calib_val;
-    int myDataSize = sizeof(calib_val);
+    // flash is programmed in whole pages, copy into a buffer of that size
+    static uint8_t myDataAsBytes[((sizeof(Settings_t) / FLASH_PAGE_SIZE) + 1) * FLASH_PAGE_SIZE];
+    int myDataSize = sizeof(settings);
+    memset(myDataAsBytes, 0xff, sizeof(myDataAsBytes));
+    memcpy(myDataAsBytes, &settings, myDataSize);
 
     int writeSize = (myDataSize / FLASH_PAGE_SIZE) + 1; // how many flash pages we're gonna need to write
     int sectorCount = ((writeSize * FLASH_PAGE_SIZE) / FLASH_SECTOR_SIZE) + 1; // how many flash sectors we're gonna need to erase
 
     printf("Programming flash target region...\n");
 
-    uint32_t interrupts = save_and_disable_interrupts();
+    // core1 executes from flash as well, park it during erase and program.
+    // The HX71708 RX FIFOs hold only 4 conversions, about 12 ms at 320 SPS,
+    // but the HX71708 interrupt keeps emptying them while core1 is parked.
+    // Conversions lost anyway show up in the status and on the console.
+    uint32_t interrupts = flash_park_begin();
     flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE * sectorCount);
     flash_range_program(FLASH_TARGET_OFFSET, myDataAsBytes, FLASH_PAGE_SIZE * writeSize);
-    restore_interrupts(interrupts);
+    flash_park_end(interrupts);
 
     printf("Done.\n");
 }
 
 void read_calib_data() {
     const uint8_t *flash_target_contents = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET);
-    memcpy(calib_val, flash_target_contents, sizeof(calib_val));
+    memcpy(&settings, flash_target_contents, sizeof(settings));
+    // written by older firmware, keep the calibration and use defaults for the rest
+    if (settings.magic != SETTINGS_MAGIC) {
+        settings.magic = SETTINGS_MAGIC;
+        memset(settings.filter, 0, sizeof(settings.filter));
+        settings.stab_window = 16;
+        settings.stab_threshold = 50;       // g
+        settings.stab_hold = 8;
+        settings.smooth_min = 1;
+        settings.smooth_max = 16;
+        settings.smooth_step = 2000;
+        apply_rate_preset(0, kHxRate10);
+        apply_rate_preset(1, kHxRate10);
+        settings.tare_num = TARE_DEFAULT;
+        settings.zero_valid = 0;
+        // straight line from the old single factor, 1.000 if there is none
+        int factor = 0;
+        for (int i = 0; i < 4; i++) {
+            if ((settings.calib_val[i] < '0') || (settings.calib_val[i] > '9')) {
+                factor = 1000;
+                break;
+            }
+            factor = factor * 10 + (settings.calib_val[i] - '0');
+        }
+        for (int i = 0; i < 2; i++) {
+            calib_table_linear(&settings.calib[i], 10 * LEGACY_COUNTS_PER_KG, 10 * factor);
+        }
+    }
+}
+
+void print_filters() {
+    char buf[32];
+    filter_chain_format(settings.filter[0], buf, sizeof(buf));
+    printf("Filter HX1: %s\n", buf);
+    filter_chain_format(settings.filter[1], buf, sizeof(buf));
+    printf("Filter HX2: %s\n", buf);
+    printf("Stability: window %d, threshold %d, hold %d -> %s\n", settings.stab_window,
+           (int)settings.stab_threshold, settings.stab_hold, stability.stable ? "stable" : "moving");
+    printf("Smoothing: window %d..%d, step %d -> HX1 %d, HX2 %d\n", settings.smooth_min, settings.smooth_max,
+           (int)settings.smooth_step, hx1.history_len, hx2.history_len);
+    printf("Tare: %d samples\n", settings.tare_num);
+    printf("Data rate: HX1 %d SPS, HX2 %d SPS\n", HX71708_rate_sps(settings.rate[0]), HX71708_rate_sps(settings.rate[1]));
+}
+
+void print_calibration(const CalibTable_t *table) {
+    for (uint i = 0; i < table->num; i++) {
+        printf(" %d=%dg", (int)table->point[i].raw, (int)table->point[i].grams);
+    }
+    printf("\n");
+}
+
+// Set the data rate of channel 1, 2 or both (0) and store it
+void set_rate(int channel, HX71708_Rate rate) {
+#if HX_LOCKSTEP
+    // both chips are clocked together and have to run at the same rate
+    channel = 0;
+#endif
+    for (int i = 0; i < 2; i++) {
+        if ((channel == 0) || (channel == i + 1)) {
+            apply_rate_preset(i, rate);
+        }
+    }
+    save_calib_data();
+    filter_update = true;
+}
+
+// execute a command from the head
+void link_command(const LinkFrame_t *cmd) {
+    uint8_t channel;
+    uint16_t sps;
+    HX71708_Rate rate;
+
+    switch (cmd->cmd) {
+    case kLinkCmdTare:
+        tare_request = true;
+        break;
+    case kLinkCmdSetRate:
+        if (link_get_set_rate(cmd, &channel, &sps) && (channel <= 2) && HX71708_rate_from_sps(sps, &rate)) {
+            set_rate(channel, rate);
+        }
+        break;
+    case kLinkCmdStatus:
+        send_status();
+        break;
+    default:
+        break;
+    }
+}
+
+void send_status() {
+    LinkFrame_t frame = { 0 };
+    LinkStatus_t status = {
+        .version = LINK_VERSION,
+        .rate_sps = { HX71708_rate_sps(settings.rate[0]), HX71708_rate_sps(settings.rate[1]) },
+        .tare_state = tare_hx1.state,
+        .link_errors = (uint16_t)(spi_slave_stats()->errors + link_errors),
+        .overflows = (uint16_t)(sample_ring.overflows + hx1.queue_overflows + hx2.queue_overflows +
+                                hx1.lost_conversions + hx2.lost_conversions)
+    };
+    link_put_status(&frame, &status);
+    link_encode(&frame, out_buf);
+    spi_slave_set_frame(out_buf, 0);
+    status_pending = true;
+    status_hold = link_frames;
+}
+
+// Weight at the time of the latch. Samples right before and after it are
+// interpolated, so subs with their own HX71708 timing agree on the
+// instant. Without a sample before the latch (start, tare, gap) the one
+// after it is sent as it is and the skew tells how far it is off. The
+// frame goes out from the main loop once a status frame before it is out.
+void send_latched(const LoadSample_t *before, const LoadSample_t *after) {
+    uint64_t latch = latch_us;
+    int32_t grams = after->value;
+    uint8_t flags = after->flags;
+    int64_t skew_us = (int64_t)(after->timestamp - latch);
+
+    bool usable = (before->timestamp < latch) && !(after->flags & (SAMPLE_FLAG_GAP | SAMPLE_FLAG_TARE_BUSY)) &&
+                  !(before->flags & SAMPLE_FLAG_TARE_BUSY);
+    if (usable) {
+        int64_t span = (int64_t)(after->timestamp - before->timestamp);
+        int64_t part = (int64_t)(latch - before->timestamp);
+        grams = before->value + (int32_t)(((int64_t)(after->value - before->value) * part) / span);
+        // only stable if it was on both sides of the latch
+        flags &= (before->flags | ~SAMPLE_FLAG_STABLE);
+        skew_us = 0;
+    }
+    if (skew_us > INT16_MAX) skew_us = INT16_MAX;
+
+    latch_frame = (LinkFrame_t){ 0 };
+    link_put_latched(&latch_frame, grams, flags, latch_num, (int16_t)skew_us);
+    latch_stamp = after->timestamp;
+    latch_due = true;
+}
+
+void send_sample(const LoadSample_t *sample) {
+    LinkFrame_t frame = { 0 };
+    // age is filled in when the frame goes out
+    link_put_sample(&frame, sample->value, sample->flags, 0, burst_pending());
+    link_encode(&frame, out_buf);
+    spi_slave_set_frame(out_buf, sample->timestamp);
+}
+
+// Set the data rate of a channel together with its filter preset. Both
+// channels share one smoothing window, it follows the preset only once
+// both run at the same rate and is kept as it is for mixed rates.
+void apply_rate_preset(int channel, HX71708_Rate rate) {
+    settings.rate[channel] = rate;
+    filter_chain_parse(rate_presets[rate].filter, settings.filter[channel]);
+    if (settings.rate[0] == settings.rate[1]) {
+        settings.smooth_min = rate_presets[rate].smooth_min;
+        settings.smooth_max = rate_presets[rate].smooth_max;
+    }
 }
\ No newline at end of file
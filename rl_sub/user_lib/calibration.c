@@ -0,0 +1,105 @@
+#include "calibration.h"
+
+void calib_table_clear(CalibTable_t *table) {
+    table->num = 0;
+}
+
+// straight line through zero and one point
+void calib_table_linear(CalibTable_t *table, int32_t raw, int32_t grams) {
+    calib_table_clear(table);
+    calib_table_add(table, 0, 0);
+    calib_table_add(table, raw, grams);
+}
+
+// Insert a point, keeping the table ordered by raw. A point with the same
+// raw value replaces the old one. Returns false if the table is full.
+bool calib_table_add(CalibTable_t *table, int32_t raw, int32_t grams) {
+    uint i = 0;
+    while ((i < table->num) && (table->point[i].raw < raw)) {
+        i++;
+    }
+    if ((i < table->num) && (table->point[i].raw == raw)) {
+        table->point[i].grams = grams;
+        return true;
+    }
+    if (table->num >= CALIB_MAX_POINTS) {
+        return false;
+    }
+    for (uint j = table->num; j > i; j--) {
+        table->point[j] = table->point[j - 1];
+    }
+    table->point[i] = (CalibPoint_t){ raw, grams };
+    table->num++;
+    return true;
+}
+
+// Calculate the segment slopes and the bucket lookup. Returns false and
+// leaves calib untouched if the table has less than two points, is not
+// ordered or a segment spans more than 2^31 g.
+bool calib_build(Calib_t *calib, const CalibTable_t *table) {
+    uint num = table->num;
+    if ((num < 2) || (num > CALIB_MAX_POINTS)) {
+        return false;
+    }
+    for (uint i = 1; i < num; i++) {
+        if (table->point[i].raw <= table->point[i - 1].raw) {
+            return false;
+        }
+        // the slope in Q32 has to fit in 64 bit
+        int64_t d_grams = (int64_t)table->point[i].grams - table->point[i - 1].grams;
+        if ((d_grams > INT32_MAX) || (d_grams < INT32_MIN)) {
+            return false;
+        }
+    }
+
+    calib->num = num;
+    for (uint i = 0; i < num; i++) {
+        calib->point[i] = table->point[i];
+    }
+    for (uint i = 0; i < num - 1; i++) {
+        int64_t d_grams = (int64_t)calib->point[i + 1].grams - calib->point[i].grams;
+        int64_t d_raw = (int64_t)calib->point[i + 1].raw - calib->point[i].raw;
+        // rounded, a truncated slope reads every weight a little low
+        int64_t scaled = d_grams * ((int64_t)1 << CALIB_Q);
+        calib->slope[i] = (scaled + ((scaled < 0) ? -d_raw : d_raw) / 2) / d_raw;
+    }
+
+    // split the calibrated range into CALIB_LUT_LEN buckets
+    uint32_t range = (uint32_t)(calib->point[num - 1].raw - calib->point[0].raw);
+    uint shift = 0;
+    while ((range >> shift) >= CALIB_LUT_LEN) {
+        shift++;
+    }
+    calib->lut_base = calib->point[0].raw;
+    calib->lut_shift = shift;
+    uint seg = 0;
+    for (uint b = 0; b < CALIB_LUT_LEN; b++) {
+        int64_t start = (int64_t)calib->lut_base + ((int64_t)b << shift);
+        while ((seg < num - 2) && (calib->point[seg + 1].raw <= start)) {
+            seg++;
+        }
+        calib->lut[b] = (uint8_t)seg;
+    }
+    return true;
+}
+
+// Counts to grams. The bucket gives the segment directly, only a bucket
+// holding a point needs one more step. Outside the table the first and
+// last segment are extended.
+int32_t calib_apply(const Calib_t *calib, int32_t raw) {
+    int64_t offset = (int64_t)raw - calib->lut_base;
+    uint b = 0;
+    if (offset > 0) {
+        offset >>= calib->lut_shift;
+        b = (offset >= CALIB_LUT_LEN) ? (CALIB_LUT_LEN - 1) : (uint)offset;
+    }
+    uint seg = calib->lut[b];
+    while ((seg < calib->num - 2) && (raw >= calib->point[seg + 1].raw)) {
+        seg++;
+    }
+    const CalibPoint_t *p = &calib->point[seg];
+    int64_t grams = p->grams + ((((int64_t)raw - p->raw) * calib->slope[seg] + ((int64_t)1 << (CALIB_Q - 1))) >> CALIB_Q);
+    if (grams > INT32_MAX) grams = INT32_MAX;
+    if (grams < INT32_MIN) grams = INT32_MIN;
+    return (int32_t)grams;
+}
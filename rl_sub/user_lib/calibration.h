@@ -0,0 +1,44 @@
+// Author: Christoph Deussen
+//
+// Piecewise linear calibration of one load cell channel. Maps zeroed
+// ADC counts to grams through up to CALIB_MAX_POINTS measured points,
+// integer only: slopes are kept in Q32 and products in 64 bit, which
+// holds up to 64 g per count over the whole 24 bit range.
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "pico/stdlib.h"
+
+#define CALIB_MAX_POINTS    8
+#define CALIB_Q             32      // fractional bits of the slopes
+#define CALIB_LUT_LEN       32      // buckets of the segment lookup
+
+typedef struct {
+    int32_t raw;            // zeroed counts
+    int32_t grams;
+} CalibPoint_t;
+
+// measured points as stored in flash, ordered by raw
+typedef struct {
+    uint8_t num;
+    CalibPoint_t point[CALIB_MAX_POINTS];
+} CalibTable_t;
+
+// table prepared for calib_apply()
+typedef struct {
+    uint num;
+    CalibPoint_t point[CALIB_MAX_POINTS];
+    int64_t slope[CALIB_MAX_POINTS - 1];    // grams per count of each segment, Q32
+    int32_t lut_base;                       // raw of the first point
+    uint lut_shift;                         // counts per bucket as power of two
+    uint8_t lut[CALIB_LUT_LEN];             // first segment of each bucket
+} Calib_t;
+
+void calib_table_clear(CalibTable_t *table);
+void calib_table_linear(CalibTable_t *table, int32_t raw, int32_t grams);
+bool calib_table_add(CalibTable_t *table, int32_t raw, int32_t grams);
+bool calib_build(Calib_t *calib, const CalibTable_t *table);
+int32_t calib_apply(const Calib_t *calib, int32_t raw);
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+static const char filter_letters[] = { '-', 'a', 'i', 'm', 'd' };
+
+static bool filter_cfg_is_valid(FilterStageCfg_t cfg) {
+    switch (cfg.type) {
+    case kFilterNone:
+        return true;
+    case kFilterAverage:
+    case kFilterDecimate:
+        return (cfg.param >= 1) && (cfg.param <= FILTER_MAX_WINDOW);
+    case kFilterIir:
+        return (cfg.param >= 1) && (cfg.param <= 16);
+    case kFilterMedian:
+        return (cfg.param >= 1) && (cfg.param <= FILTER_MAX_MEDIAN) && (cfg.param & 1);
+    default:
+        return false;
+    }
+}
+
+static void filter_stage_reset(FilterStage_t *stage, FilterStageCfg_t cfg) {
+    memset(stage, 0, sizeof(FilterStage_t));
+    stage->cfg = filter_cfg_is_valid(cfg) ? cfg : (FilterStageCfg_t){ kFilterNone, 0 };
+}
+
+void filter_chain_configure(FilterChain_t *chain, const FilterStageCfg_t cfg[FILTER_MAX_STAGES]) {
+    for (int i = 0; i < FILTER_MAX_STAGES; i++) {
+        filter_stage_reset(&chain->stage[i], cfg[i]);
+    }
+}
+
+// Running sum over a ring of the last param samples. Until the window is
+// filled the mean of the samples seen so far is returned.
+static int32_t filter_average(FilterStage_t *stage, int32_t in) {
+    uint len = stage->cfg.param;
+    if (stage->count < len) {
+        stage->count++;
+    } else {
+        stage->acc -= stage->window[stage->index];
+    }
+    stage->window[stage->index] = in;
+    stage->acc += in;
+    if (++stage->index == len) stage->index = 0;
+    // 64 samples of 24 bit fit into 32 bit, no 64 bit division needed
+    return (int32_t)stage->acc / (int32_t)stage->count;
+}
+
+// y += (x - y) / 2^k with 8 fractional bits kept in acc
+static int32_t filter_iir(FilterStage_t *stage, int32_t in) {
+    int64_t x = (int64_t)in << 8;
+    if (stage->count == 0) {
+        stage->acc = x;
+        stage->count = 1;
+    } else {
+        stage->acc += (x - stage->acc) >> stage->cfg.param;
+    }
+    return (int32_t)(stage->acc >> 8);
+}
+
+// Keeps the window sorted: the oldest sample is removed and the new one
+// inserted, at most FILTER_MAX_MEDIAN moves per sample.
+static int32_t filter_median(FilterStage_t *stage, int32_t in) {
+    uint len = stage->cfg.param;
+    uint n = stage->count;
+    int i;
+
+    if (n == len) {
+        int32_t oldest = stage->window[stage->index];
+        for (i = 0; stage->sorted[i] != oldest; i++) {
+        }
+        for (; i < (int)n - 1; i++) {
+            stage->sorted[i] = stage->sorted[i + 1];
+        }
+        n--;
+    }
+    for (i = n; (i > 0) && (stage->sorted[i - 1] > in); i--) {
+        stage->sorted[i] = stage->sorted[i - 1];
+    }
+    stage->sorted[i] = in;
+    stage->count = n + 1;
+    stage->window[stage->index] = in;
+    if (++stage->index == len) stage->index = 0;
+    return stage->sorted[stage->count / 2];
+}
+
+static bool filter_decimate(FilterStage_t *stage, int32_t in, int32_t *out) {
+    stage->acc += in;
+    stage->count++;
+    if (stage->count < stage->cfg.param) {
+        return false;
+    }
+    *out = (int32_t)stage->acc / (int32_t)stage->count;
+    stage->acc = 0;
+    stage->count = 0;
+    return true;
+}
+
+// Run one sample through all stages. Returns false if a decimator
+// swallowed the sample, *out is only written if true is returned.
+bool filter_chain_process(FilterChain_t *chain, int32_t in, int32_t *out) {
+    int32_t value = in;
+    for (int i = 0; i < FILTER_MAX_STAGES; i++) {
+        FilterStage_t *stage = &chain->stage[i];
+        switch (stage->cfg.type) {
+        case kFilterAverage:
+            value = filter_average(stage, value);
+            break;
+        case kFilterIir:
+            value = filter_iir(stage, value);
+            break;
+        case kFilterMedian:
+            value = filter_median(stage, value);
+            break;
+        case kFilterDecimate:
+            if (!filter_decimate(stage, value, &value)) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    *out = value;
+    return true;
+}
+
+// Parse a chain in console notation, e.g. "m5 a16 i3 d4".
+// Letters: a = average, i = iir, m = median, d = decimate, "-" = no filter.
+bool filter_chain_parse(const char *str, FilterStageCfg_t cfg[FILTER_MAX_STAGES]) {
+    FilterStageCfg_t parsed[FILTER_MAX_STAGES] = { 0 };
+    int n = 0;
+
+    while (*str != '\0') {
+        if (*str == ' ') {
+            str++;
+            continue;
+        }
+        if (*str == '-') {
+            str++;
+            continue;
+        }
+        if (n >= FILTER_MAX_STAGES) {
+            return false;
+        }
+        const char *letter = memchr(filter_letters, *str, sizeof(filter_letters));
+        if ((letter == NULL) || (letter == filter_letters)) {
+            return false;
+        }
+        char *end;
+        long param = strtol(str + 1, &end, 10);
+        if ((end == str + 1) || (param < 0) || (param > 255)) {
+            return false;
+        }
+        parsed[n] = (FilterStageCfg_t){ (uint8_t)(letter - filter_letters), (uint8_t)param };
+        if (!filter_cfg_is_valid(parsed[n])) {
+            return false;
+        }
+        n++;
+        str = end;
+    }
+    memcpy(cfg, parsed, sizeof(parsed));
+    return true;
+}
+
+void filter_chain_format(const FilterStageCfg_t cfg[FILTER_MAX_STAGES], char *buf, size_t len) {
+    size_t pos = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < FILTER_MAX_STAGES; i++) {
+        if ((cfg[i].type == kFilterNone) || !filter_cfg_is_valid(cfg[i])) continue;
+        pos += snprintf(buf + pos, len - pos, "%c%d ", filter_letters[cfg[i].type], cfg[i].param);
+        if (pos >= len) return;
+    }
+    if (pos == 0) {
+        snprintf(buf, len, "-");
+    }
+}
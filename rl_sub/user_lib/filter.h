@@ -0,0 +1,48 @@
+// Author: Christoph Deussen
+//
+// Configurable filter chain for load samples.
+// Every stage costs O(1) per sample, independent of its window length.
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include "pico/stdlib.h"
+
+#define FILTER_MAX_STAGES   4
+#define FILTER_MAX_WINDOW   64      // moving average and decimation factor
+#define FILTER_MAX_MEDIAN   9       // odd
+
+typedef enum FilterType {
+    kFilterNone     = 0,
+    kFilterAverage  = 1,    // running sum moving average, param = window
+    kFilterIir      = 2,    // first order low pass, param = k, alpha = 1/2^k
+    kFilterMedian   = 3,    // median of param samples, kills single spikes
+    kFilterDecimate = 4     // mean of param samples, one output per param inputs
+} FilterType;
+
+// configuration of one stage as stored in flash
+typedef struct {
+    uint8_t type;
+    uint8_t param;
+} FilterStageCfg_t;
+
+typedef struct {
+    FilterStageCfg_t cfg;
+    int32_t window[FILTER_MAX_WINDOW];
+    int32_t sorted[FILTER_MAX_MEDIAN];
+    uint index;
+    uint count;
+    int64_t acc;
+} FilterStage_t;
+
+typedef struct {
+    FilterStage_t stage[FILTER_MAX_STAGES];
+} FilterChain_t;
+
+void filter_chain_configure(FilterChain_t *chain, const FilterStageCfg_t cfg[FILTER_MAX_STAGES]);
+bool filter_chain_process(FilterChain_t *chain, int32_t in, int32_t *out);
+bool filter_chain_parse(const char *str, FilterStageCfg_t cfg[FILTER_MAX_STAGES]);
+void filter_chain_format(const FilterStageCfg_t cfg[FILTER_MAX_STAGES], char *buf, size_t len);
+
+#endif
@@ -0,0 +1,49 @@
+#include "hardware/sync.h"
+#include "flash_park.h"
+
+typedef enum ParkState {
+    kParkIdle       = 0,
+    kParkRequested  = 1,    // core0 waits for core1 to leave the flash
+    kParkParked     = 2     // core1 spins in RAM until core0 is done
+} ParkState;
+
+static volatile bool enabled = false;
+static volatile uint8_t state = kParkIdle;
+
+// Called by core1 before its loop, core0 waits for it from then on.
+void flash_park_enable() {
+    enabled = true;
+}
+
+// Core1, once per loop. Returns right away unless core0 wants the flash.
+void __not_in_flash_func(flash_park_poll)() {
+    if (state != kParkRequested) {
+        return;
+    }
+    __mem_fence_release();
+    state = kParkParked;
+    while (state != kParkIdle) {
+        tight_loop_contents();
+    }
+    __mem_fence_acquire();
+}
+
+// Core0, before a flash operation. Waits until core1 is parked and turns
+// off the interrupts of core0, whose handlers may run from flash.
+uint32_t flash_park_begin() {
+    if (enabled) {
+        state = kParkRequested;
+        while (state != kParkParked) {
+            tight_loop_contents();
+        }
+    }
+    return save_and_disable_interrupts();
+}
+
+void flash_park_end(uint32_t interrupts) {
+    restore_interrupts(interrupts);
+    if (enabled) {
+        __mem_fence_release();
+        state = kParkIdle;
+    }
+}
@@ -0,0 +1,19 @@
+// Author: Christoph Deussen
+//
+// Keeps core1 off the flash while core0 erases or programs it. Unlike the
+// SDK lockout, which spins with interrupts off, core1 waits in RAM with
+// its interrupts on, so the HX71708 interrupt goes on draining the PIO
+// FIFOs during a sector erase. Everything that interrupt touches has to
+// be in RAM.
+
+#ifndef FLASH_PARK_H
+#define FLASH_PARK_H
+
+#include "pico/stdlib.h"
+
+void flash_park_enable();
+void flash_park_poll();
+uint32_t flash_park_begin();
+void flash_park_end(uint32_t interrupts);
+
+#endif
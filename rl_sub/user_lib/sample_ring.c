@@ -0,0 +1,57 @@
+#include "hardware/sync.h"
+#include "sample_ring.h"
+
+void sample_ring_init(SampleRing_t *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overflows = 0;
+}
+
+// Producer side. The sample is copied completely before head is advanced,
+// so the consumer never sees a half written entry. If the consumer fell
+// SAMPLE_RING_LEN samples behind, the new sample is counted and discarded.
+bool __not_in_flash_func(sample_ring_push)(SampleRing_t *ring, const LoadSample_t *sample) {
+    uint32_t head = ring->head;
+    if ((head - ring->tail) >= SAMPLE_RING_LEN) {
+        ring->overflows++;
+        return false;
+    }
+    ring->buf[head & (SAMPLE_RING_LEN - 1)] = *sample;
+    __mem_fence_release();
+    ring->head = head + 1;
+    return true;
+}
+
+// Consumer side, returns false if no sample is waiting.
+bool sample_ring_pop(SampleRing_t *ring, LoadSample_t *sample) {
+    uint32_t tail = ring->tail;
+    if (ring->head == tail) {
+        return false;
+    }
+    __mem_fence_acquire();
+    *sample = ring->buf[tail & (SAMPLE_RING_LEN - 1)];
+    __mem_fence_release();
+    ring->tail = tail + 1;
+    return true;
+}
+
+// Consumer side, copies the sample index places after the oldest one and
+// leaves it in the ring. Returns false if there are not that many.
+bool sample_ring_peek(const SampleRing_t *ring, uint32_t index, LoadSample_t *sample) {
+    uint32_t tail = ring->tail;
+    if ((ring->head - tail) <= index) {
+        return false;
+    }
+    __mem_fence_acquire();
+    *sample = ring->buf[(tail + index) & (SAMPLE_RING_LEN - 1)];
+    return true;
+}
+
+// Consumer side, discards up to count of the oldest samples.
+void sample_ring_drop(SampleRing_t *ring, uint32_t count) {
+    uint32_t tail = ring->tail;
+    uint32_t waiting = ring->head - tail;
+    if (count > waiting) count = waiting;
+    __mem_fence_release();
+    ring->tail = tail + count;
+}
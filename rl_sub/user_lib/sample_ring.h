@@ -0,0 +1,44 @@
+// Author: Christoph Deussen
+//
+// Lock-free single producer / single consumer ring for finished load samples.
+// Used to hand samples from the acquisition core to the communication core.
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include "pico/stdlib.h"
+
+#define SAMPLE_RING_LEN     128     // power of two
+
+#define SAMPLE_FLAG_STABLE      0x01    // no motion on the pad
+#define SAMPLE_FLAG_TARE_BUSY   0x02    // tare running, value is held
+#define SAMPLE_FLAG_TARE_DONE   0x04    // last tare finished, value is zeroed
+#define SAMPLE_FLAG_GAP         0x08    // samples before this one were dropped
+
+typedef struct {
+    int32_t value;          // calibrated sum of both channels
+    int hx1;
+    int hx2;
+    uint64_t timestamp;     // time the conversion was ready in us
+    uint8_t flags;          // SAMPLE_FLAG_*
+} LoadSample_t;
+
+typedef struct {
+    LoadSample_t buf[SAMPLE_RING_LEN];
+    volatile uint32_t head;     // written by producer only
+    volatile uint32_t tail;     // written by consumer only
+    volatile uint32_t overflows;
+} SampleRing_t;
+
+void sample_ring_init(SampleRing_t *ring);
+bool sample_ring_push(SampleRing_t *ring, const LoadSample_t *sample);
+bool sample_ring_pop(SampleRing_t *ring, LoadSample_t *sample);
+bool sample_ring_peek(const SampleRing_t *ring, uint32_t index, LoadSample_t *sample);
+void sample_ring_drop(SampleRing_t *ring, uint32_t count);
+
+// samples waiting, safe to call from either side
+static inline uint32_t sample_ring_count(const SampleRing_t *ring) {
+    return ring->head - ring->tail;
+}
+
+#endif
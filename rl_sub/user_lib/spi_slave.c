@@ -0,0 +1,162 @@
+#include <string.h>
+
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "spi_slave.h"
+#include "spi_slave.pio.h"
+
+static uint data_sm;
+static uint data_offset;
+static uint miso;
+static uint tx_dma;
+static uint rx_dma;
+static SpiSlaveHook_t slave_hook;
+
+static uint8_t tx_buf[2][SPI_SLAVE_FRAME_LEN];
+static uint64_t tx_stamp[2];
+static volatile uint tx_active = 0;         // buffer the TX DMA reads from
+static volatile bool tx_pending = false;    // other buffer holds a newer frame
+static uint8_t tx_wire[SPI_SLAVE_TX_MAX];       // copy of the active frame on the wire
+static uint tx_len = SPI_SLAVE_FRAME_LEN;
+static uint8_t rx_buf[SPI_SLAVE_TX_MAX];    // the head sends filler while a burst goes out
+static uint8_t rx_frame[SPI_SLAVE_FRAME_LEN];
+static volatile bool rx_ready = false;
+static SpiSlaveStats_t stats;
+
+// Load the next frame and start the data state machine. It waits for chip
+// select to go low, DMA keeps the FIFOs fed, so nothing has to happen until
+// chip select goes high again. MISO idles high until the first falling SCK
+// edge of our own transaction, so the head can sense the sub by only
+// pulling chip select. Other subs' clocks do not reach the pin.
+static void spi_slave_arm() {
+    pio_sm_set_pins_with_mask(SPI_SLAVE_PIO, data_sm, 1u << miso, 1u << miso);
+    dma_channel_transfer_to_buffer_now(rx_dma, rx_buf, SPI_SLAVE_TX_MAX);
+    dma_channel_transfer_from_buffer_now(tx_dma, tx_wire, tx_len);
+    pio_sm_set_enabled(SPI_SLAVE_PIO, data_sm, true);
+}
+
+// Stop the data state machine and throw away whatever is left of the last
+// transaction: bits of a partial byte, unsent bytes of a short one, the
+// one bit a foreign clock may have moved before we got here.
+static void spi_slave_stop() {
+    pio_sm_set_enabled(SPI_SLAVE_PIO, data_sm, false);
+    dma_channel_abort(tx_dma);
+    dma_channel_abort(rx_dma);
+    pio_sm_clear_fifos(SPI_SLAVE_PIO, data_sm);
+    pio_sm_restart(SPI_SLAVE_PIO, data_sm);
+    pio_sm_exec(SPI_SLAVE_PIO, data_sm, pio_encode_jmp(data_offset + spi_slave_offset_start));
+}
+
+// Raised by spi_slave_cs when chip select goes high. Takes over the
+// received frame, swaps in the newest frame to send and rearms the DMA.
+static void __not_in_flash_func(spi_slave_irq_handler)() {
+    pio_interrupt_clear(SPI_SLAVE_PIO, 0);
+
+    // the last byte was pushed on the last rising SCK edge
+    while (dma_channel_is_busy(rx_dma) && !pio_sm_is_rx_fifo_empty(SPI_SLAVE_PIO, data_sm)) {
+        tight_loop_contents();
+    }
+    uint received = SPI_SLAVE_TX_MAX - dma_channel_hw_addr(rx_dma)->transfer_count;
+    spi_slave_stop();
+
+    // chip select without clock: the head only checked that we are there,
+    // the frame on the wire was not sent and goes out again
+    if (received == 0) {
+        stats.probes++;
+        spi_slave_arm();
+        return;
+    }
+
+    bool complete = (received >= SPI_SLAVE_FRAME_LEN);
+    if (complete) {
+        memcpy(rx_frame, rx_buf, SPI_SLAVE_FRAME_LEN);
+        rx_ready = true;
+        stats.transactions++;
+    } else {
+        stats.errors++;
+    }
+    if (tx_pending) {
+        tx_active ^= 1;
+        tx_pending = false;
+    }
+    memcpy(tx_wire, tx_buf[tx_active], SPI_SLAVE_FRAME_LEN);
+    tx_len = SPI_SLAVE_FRAME_LEN;
+    if (slave_hook != NULL) {
+        tx_len = slave_hook(complete ? rx_frame : NULL, tx_wire, tx_stamp[tx_active]);
+        if ((tx_len < SPI_SLAVE_FRAME_LEN) || (tx_len > SPI_SLAVE_TX_MAX)) {
+            tx_len = SPI_SLAVE_FRAME_LEN;
+        }
+    }
+    spi_slave_arm();
+}
+
+void spi_slave_init(uint mosi_pin, uint miso_pin, SpiSlaveHook_t hook) {
+    PIO pio = SPI_SLAVE_PIO;
+    uint cs_pin = mosi_pin + 1;
+    slave_hook = hook;
+    miso = miso_pin;
+
+    gpio_init(mosi_pin);
+    gpio_init(cs_pin);
+    gpio_init(mosi_pin + 2);
+
+    data_offset = pio_add_program(pio, &spi_slave_program);
+    data_sm = pio_claim_unused_sm(pio, true);
+    spi_slave_program_init(pio, data_sm, data_offset, mosi_pin, miso_pin);
+
+    uint cs_offset = pio_add_program(pio, &spi_slave_cs_program);
+    uint cs_sm = pio_claim_unused_sm(pio, true);
+    spi_slave_cs_program_init(pio, cs_sm, cs_offset, cs_pin, miso_pin);
+
+    tx_dma = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(tx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, data_sm, true));
+    dma_channel_configure(tx_dma, &c, &pio->txf[data_sm], tx_wire, SPI_SLAVE_FRAME_LEN, false);
+
+    rx_dma = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(rx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, data_sm, false));
+    dma_channel_configure(rx_dma, &c, rx_buf, &pio->rxf[data_sm], SPI_SLAVE_TX_MAX, false);
+
+    irq_set_exclusive_handler(SPI_SLAVE_PIO_IRQ, spi_slave_irq_handler);
+    irq_set_enabled(SPI_SLAVE_PIO_IRQ, true);
+    pio_set_irq0_source_enabled(pio, pis_interrupt0, true);
+
+    spi_slave_arm();
+    pio_sm_set_enabled(pio, cs_sm, true);
+}
+
+// Hand over the frame for one of the next transactions. Only the pending
+// buffer is written, the one on the wire stays untouched.
+void spi_slave_set_frame(const uint8_t *frame, uint64_t stamp) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    memcpy(tx_buf[tx_active ^ 1], frame, SPI_SLAVE_FRAME_LEN);
+    tx_stamp[tx_active ^ 1] = stamp;
+    tx_pending = true;
+    restore_interrupts(interrupts);
+}
+
+// Copy the last complete frame from the head. Returns false if there was
+// no new one since the last call.
+bool spi_slave_get_frame(uint8_t *frame) {
+    if (!rx_ready) {
+        return false;
+    }
+    uint32_t interrupts = save_and_disable_interrupts();
+    memcpy(frame, rx_frame, SPI_SLAVE_FRAME_LEN);
+    rx_ready = false;
+    restore_interrupts(interrupts);
+    return true;
+}
+
+const SpiSlaveStats_t *spi_slave_stats() {
+    return &stats;
+}
@@ -0,0 +1,42 @@
+// Author: Christoph Deussen
+//
+// PIO and DMA driven SPI slave for the link to the head unit. One frame is
+// sent and received per chip select cycle. The frame to send is double
+// buffered and only swapped while chip select is high, so every transaction
+// carries one consistent sample. MISO is released by the PIO itself while
+// chip select is high, see spi_slave.pio.
+
+#ifndef SPI_SLAVE_H
+#define SPI_SLAVE_H
+
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+
+#include "link_protocol.h"
+
+#define SPI_SLAVE_FRAME_LEN     LINK_FRAME_LEN
+#define SPI_SLAVE_TX_MAX        LINK_BURST_MAX_LEN
+#define SPI_SLAVE_PIO           pio1
+#define SPI_SLAVE_PIO_IRQ       PIO1_IRQ_0
+
+// Called from the end of transaction interrupt right before a frame is loaded for
+// the next transaction. rx is the frame just received, NULL if it was cut
+// short. tx is a copy of the frame about to go out and may be changed or
+// replaced for this one transaction, stamp is the one given with the frame.
+// Returns the number of bytes to send, up to SPI_SLAVE_TX_MAX. Bytes the
+// head clocks beyond SPI_SLAVE_FRAME_LEN are not received.
+typedef uint (*SpiSlaveHook_t)(const uint8_t *rx, uint8_t *tx, uint64_t stamp);
+
+typedef struct {
+    uint32_t transactions;      // complete frames
+    uint32_t errors;            // chip select went high in the middle of a frame
+    uint32_t probes;            // chip select without clock, presence check of the head
+} SpiSlaveStats_t;
+
+// chip select and SCK are the two pins following mosi_pin
+void spi_slave_init(uint mosi_pin, uint miso_pin, SpiSlaveHook_t hook);
+void spi_slave_set_frame(const uint8_t *frame, uint64_t stamp);
+bool spi_slave_get_frame(uint8_t *frame);
+const SpiSlaveStats_t *spi_slave_stats();
+
+#endif
@@ -0,0 +1,67 @@
+#include "stability.h"
+
+void stability_init(Stability_t *stab, uint window, int32_t threshold, uint hold) {
+    if (window < 2) window = 2;
+    if (window > STAB_MAX_WINDOW) window = STAB_MAX_WINDOW;
+    stab->window = window;
+    stab->threshold = threshold;
+    stab->hold = hold;
+    stab->index = 0;
+    stab->count = 0;
+    stab->sum = 0;
+    stab->sum_sq = 0;
+    stab->quiet_count = 0;
+    stab->stable = false;
+}
+
+// Feed one sample, O(1). Returns the stable flag.
+bool stability_update(Stability_t *stab, int32_t value) {
+    if (stab->count == 0) {
+        stab->ref = value;
+    }
+    int64_t x = (int64_t)value - stab->ref;
+    int64_t oldest = x;
+
+    if (stab->count < stab->window) {
+        stab->count++;
+    } else {
+        oldest = stab->buf[stab->index];
+        stab->sum -= oldest;
+        stab->sum_sq -= oldest * oldest;
+    }
+    stab->buf[stab->index] = (int32_t)x;
+    stab->sum += x;
+    stab->sum_sq += x * x;
+    if (++stab->index == stab->window) stab->index = 0;
+
+    if (stab->count < stab->window) {
+        stab->stable = false;
+        return false;
+    }
+
+    // n^2 * variance = n * sum(x^2) - sum(x)^2, compared without division or sqrt
+    int64_t n = stab->count;
+    int64_t var_n2 = n * stab->sum_sq - stab->sum * stab->sum;
+    int64_t limit_n2 = (int64_t)stab->threshold * stab->threshold * n * n;
+    // slope as change between the oldest and the newest sample of the window
+    int64_t change = x - oldest;
+    bool quiet = (var_n2 <= limit_n2) && (change <= stab->threshold) && (change >= -stab->threshold);
+
+    if (!quiet) {
+        stab->quiet_count = 0;
+        stab->stable = false;
+        // re-center while moving so the squares stay small
+        if ((x > (1 << 20)) || (x < -(1 << 20))) {
+            stab->ref = value;
+            stab->count = 0;
+            stab->index = 0;
+            stab->sum = 0;
+            stab->sum_sq = 0;
+        }
+    } else if (stab->quiet_count < stab->hold) {
+        stab->quiet_count++;
+    } else {
+        stab->stable = true;
+    }
+    return stab->stable;
+}
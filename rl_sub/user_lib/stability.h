@@ -0,0 +1,31 @@
+// Author: Christoph Deussen
+//
+// Motion detection for load samples. Tracks variance and change over a
+// sliding window and reports a reading as stable once both stayed below
+// a threshold for a number of samples.
+
+#ifndef STABILITY_H
+#define STABILITY_H
+
+#include "pico/stdlib.h"
+
+#define STAB_MAX_WINDOW     64
+
+typedef struct {
+    uint window;            // samples in the sliding window
+    int32_t threshold;      // max. standard deviation and max. change over the window
+    uint hold;              // samples the criteria have to hold before stable
+    int32_t buf[STAB_MAX_WINDOW];
+    uint index;
+    uint count;
+    int32_t ref;            // values are kept relative to this to stay within 64 bit
+    int64_t sum;
+    int64_t sum_sq;
+    uint quiet_count;
+    bool stable;
+} Stability_t;
+
+void stability_init(Stability_t *stab, uint window, int32_t threshold, uint hold);
+bool stability_update(Stability_t *stab, int32_t value);
+
+#endif
@@ -0,0 +1,37 @@
+#include "tare.h"
+
+void tare_start(Tare_t *tare, uint num) {
+    if (num < 4) num = 4;
+    if (num > TARE_MAX_SAMPLES) num = TARE_MAX_SAMPLES;
+    tare->num = num;
+    tare->count = 0;
+    tare->state = kTareBusy;
+}
+
+// Collect one raw conversion. Returns true once enough samples are in,
+// the offset can then be taken with tare_result().
+bool tare_add(Tare_t *tare, int32_t raw) {
+    if (tare->state != kTareBusy) {
+        return false;
+    }
+    // insertion sort, the buffer stays ordered
+    uint i = tare->count;
+    while ((i > 0) && (tare->buf[i - 1] > raw)) {
+        tare->buf[i] = tare->buf[i - 1];
+        i--;
+    }
+    tare->buf[i] = raw;
+    tare->count++;
+    return tare->count >= tare->num;
+}
+
+// Mean of the samples without the lowest and highest quarter.
+int32_t tare_result(Tare_t *tare) {
+    uint trim = tare->count / 4;
+    int64_t sum = 0;
+    for (uint i = trim; i < tare->count - trim; i++) {
+        sum += tare->buf[i];
+    }
+    tare->state = kTareDone;
+    return (int32_t)(sum / (int64_t)(tare->count - 2 * trim));
+}
@@ -0,0 +1,32 @@
+// Author: Christoph Deussen
+//
+// Background tare of one load cell channel. Collects raw conversions while
+// the output keeps running and calculates the new zero offset as trimmed
+// mean, so single spikes from a bump or a bad conversion are rejected.
+
+#ifndef TARE_H
+#define TARE_H
+
+#include "pico/stdlib.h"
+
+#define TARE_MAX_SAMPLES    64
+#define TARE_DEFAULT        16
+
+typedef enum TareState {
+    kTareIdle   = 0,
+    kTareBusy   = 1,
+    kTareDone   = 2
+} TareState;
+
+typedef struct {
+    TareState state;
+    uint num;               // samples to collect
+    uint count;
+    int32_t buf[TARE_MAX_SAMPLES];
+} Tare_t;
+
+void tare_start(Tare_t *tare, uint num);
+bool tare_add(Tare_t *tare, int32_t raw);
+int32_t tare_result(Tare_t *tare);
+
+#endif
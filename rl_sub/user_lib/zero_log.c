@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "flash_park.h"
+#include "zero_log.h"
+
+static_assert((ZERO_LOG_OFFSET % FLASH_SECTOR_SIZE) == 0, "ZERO_LOG_OFFSET must be sector aligned");
+static_assert((FLASH_PAGE_SIZE % sizeof(ZeroEntry_t)) == 0, "entries must not cross a page");
+
+static uint next_entry = 0;
+
+static const ZeroEntry_t *log_entry(uint index) {
+    return (const ZeroEntry_t *)(XIP_BASE + ZERO_LOG_OFFSET + index * sizeof(ZeroEntry_t));
+}
+
+static bool entry_valid(const ZeroEntry_t *entry) {
+    return (entry->magic == ZERO_LOG_MAGIC) && (entry->check == ~(uint32_t)(entry->offset[0] ^ entry->offset[1]));
+}
+
+// core1 executes from flash as well, park it if it runs already
+static void log_flash(bool erase, uint32_t offset, const uint8_t *data) {
+    uint32_t interrupts = flash_park_begin();
+    if (erase) {
+        flash_range_erase(ZERO_LOG_OFFSET, FLASH_SECTOR_SIZE);
+    } else {
+        flash_range_program(offset, data, FLASH_PAGE_SIZE);
+    }
+    flash_park_end(interrupts);
+}
+
+// Find the newest zero, returns false if there is none. A log more than
+// half full is erased and the zero written again as its first entry.
+// Entries broken by a reset during programming are skipped.
+bool zero_log_init(int32_t offset[2]) {
+    bool found = false;
+    next_entry = 0;
+    for (uint i = 0; i < ZERO_LOG_ENTRIES; i++) {
+        const ZeroEntry_t *entry = log_entry(i);
+        if (entry->magic == 0xffffffff) {
+            break;
+        }
+        next_entry = i + 1;
+        if (entry_valid(entry)) {
+            offset[0] = entry->offset[0];
+            offset[1] = entry->offset[1];
+            found = true;
+        }
+    }
+    if (next_entry > ZERO_LOG_ENTRIES / 2) {
+        log_flash(true, 0, NULL);
+        next_entry = 0;
+        if (found) {
+            zero_log_write(offset);
+        }
+    }
+    return found;
+}
+
+// Append a zero. Only the bytes of the entry are programmed, the rest of
+// the page is written as 0xff and stays as it is. More zeros than fit
+// into one run erase the sector here, a stall once in a long while.
+void zero_log_write(const int32_t offset[2]) {
+    static uint8_t page[FLASH_PAGE_SIZE];
+    if (next_entry >= ZERO_LOG_ENTRIES) {
+        log_flash(true, 0, NULL);
+        next_entry = 0;
+    }
+    ZeroEntry_t entry = {
+        .magic = ZERO_LOG_MAGIC,
+        .offset = { offset[0], offset[1] },
+        .check = ~(uint32_t)(offset[0] ^ offset[1])
+    };
+    uint32_t addr = next_entry * sizeof(ZeroEntry_t);
+    memset(page, 0xff, sizeof(page));
+    memcpy(&page[addr % FLASH_PAGE_SIZE], &entry, sizeof(entry));
+    log_flash(false, ZERO_LOG_OFFSET + addr - (addr % FLASH_PAGE_SIZE), page);
+    next_entry++;
+}
@@ -0,0 +1,29 @@
+// Author: Christoph Deussen
+//
+// Log of the tare zeros in a flash sector of its own. A new zero is
+// appended with a single page program, which takes less than a
+// millisecond, instead of erasing the settings sector. The sector is
+// erased at boot once it is more than half full, before the acquisition
+// runs.
+
+#ifndef ZERO_LOG_H
+#define ZERO_LOG_H
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#define ZERO_LOG_OFFSET     ((512 + 4) * 1024)  // sector behind the settings
+#define ZERO_LOG_MAGIC      0x304f525a          // "ZRO0"
+
+typedef struct {
+    uint32_t magic;
+    int32_t offset[2];
+    uint32_t check;         // ~(offset[0] ^ offset[1])
+} ZeroEntry_t;
+
+#define ZERO_LOG_ENTRIES    (FLASH_SECTOR_SIZE / sizeof(ZeroEntry_t))
+
+bool zero_log_init(int32_t offset[2]);
+void zero_log_write(const int32_t offset[2]);
+
+#endif